@@ -5,26 +5,65 @@
  * @Last Modified time: 2020-06-15 12:02:36
  */
 
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stddef.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
-#include "llvm/IR/LegacyPassManager.h"
-#include "../include/KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
@@ -32,11 +71,34 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopRotation.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/InjectTLIMappings.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/Transforms/Vectorize/SLPVectorizer.h"
 
 using namespace llvm;
 using namespace llvm::orc;
@@ -51,20 +113,28 @@ class numExprAST;
 class variableExprAST;
 class binaryExprAST;
 class callExprAST;
+class ifExprAST;
+class forExprAST;
+class varExprAST;
 class prototypeAST;
 class functionAST;
+class astWriter;
+enum valueType : uint8_t;
 
 static unique_ptr<exprAST> parseNumberExpr();
-static unique_ptr<exprAST> parseParenExpr();
 static unique_ptr<exprAST> parseIdentifierExpr();
+static unique_ptr<exprAST> parseIfExpr();
+static unique_ptr<exprAST> parseForExpr();
+static unique_ptr<exprAST> parseVarExpr();
 static unique_ptr<exprAST> parsePrimay();
 static unique_ptr<exprAST> parseExpression();
-static unique_ptr<exprAST> parseBinaryOperatorRHS(int exprPrec,
-                                                  unique_ptr<exprAST> LHS);
+static bool parseType(valueType& type);
 static unique_ptr<prototypeAST> parsePrototype();
 static unique_ptr<functionAST> parseDefinition();
 static unique_ptr<prototypeAST> parseExtern();
+static string parseForget();
 static unique_ptr<functionAST> parseTopLevelExpr();
+unique_ptr<exprAST> logError(const char* Str);
 
 /**
  * * 词法分析
@@ -78,51 +148,393 @@ enum Token {
     tokExtern = -3,      // extern关键字
     tokIdentifier = -4,  //标识符
     tokNum = -5,         //数字
+    tokError = -6,       //词法错误, 已经报告过
+
+    // control flow
+    tokIf = -7,    // if
+    tokThen = -8,  // then
+    tokElse = -9,  // else
+    tokFor = -10,  // for
+    tokIn = -11,   // in
+
+    // mutable locals
+    tokVar = -12,  // var
+
+    // memoization
+    tokMemo = -13,  // memo
+
+    // session memory
+    tokForget = -14,  // forget
 };
 
-static string identifierStr;  //标识符字符串
-static double numValue;       //数字的值
+// Every piece of front-end state is thread_local so that each compile server
+// session (see serveSessions) lexes, parses and generates code independently
+// on whichever worker thread it runs on.
+static thread_local FILE* sessionIn = stdin;    //源代码输入
+static thread_local FILE* sessionOut = stderr;  //诊断与结果输出
+static thread_local bool sessionPrompt = true;  //是否打印 "ready> "
 
-// returnNextTokenFromInput - return next token form standard input
-static int returnNextTokenFromInput() {
-    static int lastChar = ' ';
+static thread_local string identifierStr;  //标识符字符串
+static thread_local double numValue;       //数字的值
 
-    // delete the whitespace
-    while (isspace(lastChar)) lastChar = getchar();
+// charClasses - character class of every byte, replaces the <cctype> calls
+enum charClass : uint8_t {
+    ccSpace = 1,      // isspace
+    ccAlpha = 2,      // isalpha, starts an identifier
+    ccAlnum = 4,      // isalnum, continues an identifier
+    ccNumber = 8,     // digit or '.', part of a numeric literal
+    ccLineEnd = 16,   // ends a '#' comment
+};
+static const array<uint8_t, 256> charClasses = [] {
+    array<uint8_t, 256> table{};
+    for (int c : {' ', '\t', '\n', '\v', '\f', '\r'}) table[c] |= ccSpace;
+    for (int c = 'a'; c <= 'z'; ++c) table[c] |= ccAlpha | ccAlnum;
+    for (int c = 'A'; c <= 'Z'; ++c) table[c] |= ccAlpha | ccAlnum;
+    for (int c = '0'; c <= '9'; ++c) table[c] |= ccAlnum | ccNumber;
+    table['.'] |= ccNumber;
+    table['\n'] |= ccLineEnd;
+    table['\r'] |= ccLineEnd;
+    return table;
+}();
 
-    if (isalpha(lastChar)) {
-        // identifier of source
-        identifierStr = lastChar;
-        while (isalnum(lastChar = getchar())) identifierStr += lastChar;
-        if (identifierStr == "def") return tokDef;
-        if (identifierStr == "extern") return tokExtern;
-        return tokIdentifier;
+// keywordTable - perfect hash of the keywords: keywordHash sends every keyword
+// to its own slot, so a lookup is one hash, one length check and one memcmp.
+// The initializer asserts that adding a keyword keeps the hash perfect.
+struct keywordSlot {
+    const char* text;
+    size_t length;
+    int token;
+};
+static inline unsigned keywordHash(const char* str, size_t length) {
+    return (length + (unsigned char)str[0] * 3 +
+            (unsigned char)str[length - 1] * 3) & 31;
+}
+static const array<keywordSlot, 32> keywordTable = [] {
+    const keywordSlot keywords[] = {
+        {"def", 3, tokDef},
+        {"extern", 6, tokExtern},
+        {"if", 2, tokIf},
+        {"then", 4, tokThen},
+        {"else", 4, tokElse},
+        {"for", 3, tokFor},
+        {"in", 2, tokIn},
+        {"var", 3, tokVar},
+        {"memo", 4, tokMemo},
+        {"forget", 6, tokForget},
+    };
+    array<keywordSlot, 32> table{};
+    for (auto& K : keywords) {
+        auto& slot = table[keywordHash(K.text, K.length)];
+        assert(!slot.text && "keywordHash is no longer perfect");
+        slot = K;
     }
+    return table;
+}();
+static int keywordToken(const char* str, size_t length) {
+    auto& slot = keywordTable[keywordHash(str, length)];
+    if (slot.length == length && !memcmp(slot.text, str, length))
+        return slot.token;
+    return tokIdentifier;
+}
 
-    if (isdigit(lastChar) || lastChar == '.') {
-        // digit of source
-        string numStr;
-        do {
-            numStr += lastChar;
-            lastChar = getchar();
-        } while (isdigit(lastChar) || lastChar == '.');
-        numValue = strtod(numStr.c_str(), 0);
-        return tokNum;
+// SIMD scanners - skip a run of one character class 16 (SSE2) or 32 (AVX2)
+// bytes at a time and return the first byte outside it; the scalar loops
+// finish the tail and are the whole scanner on other targets.
+#if defined(__AVX2__)
+#define JVAV_LEX_SIMD
+typedef __m256i lexVec;
+static const ptrdiff_t lexStride = 32;
+static inline lexVec lexLoad(const char* p) {
+    return _mm256_loadu_si256((const __m256i*)p);
+}
+static inline lexVec lexSplat(char c) { return _mm256_set1_epi8(c); }
+static inline lexVec lexEq(lexVec a, lexVec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline lexVec lexOr(lexVec a, lexVec b) { return _mm256_or_si256(a, b); }
+static inline lexVec lexSub(lexVec a, lexVec b) { return _mm256_sub_epi8(a, b); }
+static inline lexVec lexMin(lexVec a, lexVec b) { return _mm256_min_epu8(a, b); }
+static inline uint32_t lexMask(lexVec v) {
+    return (uint32_t)_mm256_movemask_epi8(v);
+}
+static const uint32_t lexAllLanes = 0xffffffffu;
+#elif defined(__SSE2__)
+#define JVAV_LEX_SIMD
+typedef __m128i lexVec;
+static const ptrdiff_t lexStride = 16;
+static inline lexVec lexLoad(const char* p) {
+    return _mm_loadu_si128((const __m128i*)p);
+}
+static inline lexVec lexSplat(char c) { return _mm_set1_epi8(c); }
+static inline lexVec lexEq(lexVec a, lexVec b) { return _mm_cmpeq_epi8(a, b); }
+static inline lexVec lexOr(lexVec a, lexVec b) { return _mm_or_si128(a, b); }
+static inline lexVec lexSub(lexVec a, lexVec b) { return _mm_sub_epi8(a, b); }
+static inline lexVec lexMin(lexVec a, lexVec b) { return _mm_min_epu8(a, b); }
+static inline uint32_t lexMask(lexVec v) {
+    return (uint32_t)_mm_movemask_epi8(v);
+}
+static const uint32_t lexAllLanes = 0xffffu;
+#endif
+
+#ifdef JVAV_LEX_SIMD
+// lexInRange - lanes whose byte is in [lo, lo + span], as an unsigned compare
+static inline lexVec lexInRange(lexVec v, char lo, char span) {
+    lexVec offset = lexSub(v, lexSplat(lo));
+    return lexEq(lexMin(offset, lexSplat(span)), offset);
+}
+#endif
+
+// skipSpaces - first non whitespace byte in [p, end)
+static const char* skipSpaces(const char* p, const char* end) {
+#ifdef JVAV_LEX_SIMD
+    for (; end - p >= lexStride; p += lexStride) {
+        lexVec v = lexLoad(p);
+        uint32_t space = lexMask(
+            lexOr(lexEq(v, lexSplat(' ')), lexInRange(v, '\t', '\r' - '\t')));
+        if (space != lexAllLanes) return p + __builtin_ctz(~space);
+    }
+#endif
+    while (p != end && (charClasses[(unsigned char)*p] & ccSpace)) ++p;
+    return p;
+}
+
+// scanIdentifier - first byte in [p, end) that cannot continue an identifier
+static const char* scanIdentifier(const char* p, const char* end) {
+#ifdef JVAV_LEX_SIMD
+    for (; end - p >= lexStride; p += lexStride) {
+        lexVec v = lexLoad(p);
+        uint32_t alnum = lexMask(lexOr(lexInRange(v, '0', 9),
+                                       lexInRange(lexOr(v, lexSplat(0x20)),
+                                                  'a', 'z' - 'a')));
+        if (alnum != lexAllLanes) return p + __builtin_ctz(~alnum);
     }
+#endif
+    while (p != end && (charClasses[(unsigned char)*p] & ccAlnum)) ++p;
+    return p;
+}
 
-    if (lastChar == '#') {
-        // process comment
-        do {
-            lastChar = getchar();
-        } while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
-        if (lastChar != EOF) return returnNextTokenFromInput();
+// findLineEnd - first '\n' or '\r' in [p, end)
+static const char* findLineEnd(const char* p, const char* end) {
+#ifdef JVAV_LEX_SIMD
+    for (; end - p >= lexStride; p += lexStride) {
+        lexVec v = lexLoad(p);
+        uint32_t lineEnd =
+            lexMask(lexOr(lexEq(v, lexSplat('\n')), lexEq(v, lexSplat('\r'))));
+        if (lineEnd) return p + __builtin_ctz(lineEnd);
+    }
+#endif
+    while (p != end && !(charClasses[(unsigned char)*p] & ccLineEnd)) ++p;
+    return p;
+}
+
+// lexBuffer - the lexer's window onto the session input. Refilling moves the
+// token being scanned to the front first, so a token is always contiguous.
+struct lexBuffer {
+    unique_ptr<char[]> data;
+    size_t capacity = 0;
+    const char* tokStart = NULL;  // start of the token being scanned
+    const char* cur = NULL;       // next unread byte
+    const char* end = NULL;       // one past the last byte read
+    bool complete = false;        // all of the input is buffered, see lexSource
+    const char* lineMark = NULL;  // lines are counted up to here, see lexLine
+    unsigned line = 1;            // the line lineMark is on
+};
+static thread_local lexBuffer lexBuf;
+
+// resetLexer - forget any buffered input, called when a session starts
+static void resetLexer() {
+    lexBuf.capacity = 1 << 16;
+    lexBuf.data.reset(new char[lexBuf.capacity]);
+    lexBuf.tokStart = lexBuf.cur = lexBuf.end = lexBuf.data.get();
+    lexBuf.complete = false;
+    lexBuf.lineMark = lexBuf.data.get();
+    lexBuf.line = 1;
+}
+
+// lexSource - lex text instead of the session input until the next reset;
+// firstLine is the line text starts on, for the line numbers of errors
+static void lexSource(StringRef text, unsigned firstLine = 1) {
+    lexBuf.capacity = max<size_t>(text.size(), 1);
+    lexBuf.data.reset(new char[lexBuf.capacity]);
+    memcpy(lexBuf.data.get(), text.data(), text.size());
+    lexBuf.tokStart = lexBuf.cur = lexBuf.data.get();
+    lexBuf.end = lexBuf.cur + text.size();
+    lexBuf.complete = true;
+    lexBuf.lineMark = lexBuf.data.get();
+    lexBuf.line = firstLine;
+}
+
+// lexLine - the line the token being scanned starts on. Lines are counted
+// only when asked for, so the lexer's hot loops never look for '\n'.
+static unsigned lexLine() {
+    lexBuffer& B = lexBuf;
+    B.line += std::count(B.lineMark, B.tokStart, '\n');
+    B.lineMark = B.tokStart;
+    return B.line;
+}
+
+// refillLexBuffer - read more input after lexBuf.end, keeping the bytes from
+// lexBuf.tokStart on. Returns false if nothing more could be read.
+static bool refillLexBuffer() {
+    lexBuffer& B = lexBuf;
+    if (B.complete) return false;
+    size_t keep = B.end - B.tokStart, curOffset = B.cur - B.tokStart;
+    lexLine();  // count the lines about to be dropped
+    if (keep == B.capacity) {
+        // a single token fills the whole buffer
+        unique_ptr<char[]> bigger(new char[B.capacity * 2]);
+        memcpy(bigger.get(), B.tokStart, keep);
+        B.data = move(bigger);
+        B.capacity *= 2;
+    } else {
+        memmove(B.data.get(), B.tokStart, keep);
+    }
+    char* base = B.data.get();
+    B.tokStart = B.lineMark = base;
+    B.cur = base + curOffset;
+    B.end = base + keep;
+
+    ssize_t n;
+    do {
+        n = read(fileno(sessionIn), base + keep, B.capacity - keep);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return false;
+    B.end += n;
+    return true;
+}
+
+// scanRun - extend the token at lexBuf.tokStart with bytes from p on for as
+// long as scan accepts them, refilling the buffer when the run reaches its end
+static const char* scanRun(const char* p,
+                           const char* (*scan)(const char*, const char*)) {
+    while ((p = scan(p, lexBuf.end)) == lexBuf.end) {
+        size_t offset = p - lexBuf.tokStart;
+        bool more = refillLexBuffer();
+        p = lexBuf.tokStart + offset;
+        if (!more) break;
+    }
+    return p;
+}
+
+// lexRestOfLine - the text after the current token up to the end of its
+// line, without the spaces around it
+static string lexRestOfLine() {
+    lexBuffer& B = lexBuf;
+    B.tokStart = B.cur;
+    B.cur = scanRun(B.cur, findLineEnd);
+    StringRef text(B.tokStart, B.cur - B.tokStart);
+    return text.trim().str();
+}
+
+static const char* scanNumber(const char* p, const char* end) {
+    while (p != end && (charClasses[(unsigned char)*p] & ccNumber)) ++p;
+    return p;
+}
+
+// parseNumberLiteral - convert the literal [begin, end) in place, where
+// number ::= digits ['.' [digits]] | '.' digits
+// Literals with at most 19 significant digits whose value and power of ten
+// are exact doubles take Clinger's fast path, a single correctly rounded
+// multiply or divide; anything else is handed to strtod from a stack copy.
+static bool parseNumberLiteral(const char* begin, const char* end,
+                               double& value) {
+    static const double powersOfTen[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    uint64_t mantissa = 0;
+    int significant = 0, exponent = 0, digits = 0, dots = 0;
+    bool truncated = false;
+    for (const char* p = begin; p != end; ++p) {
+        if (*p == '.') {
+            if (++dots > 1) return false;
+            continue;
+        }
+        ++digits;
+        if (mantissa == 0 && *p == '0') {
+            if (dots) --exponent;  // leading zero after the point
+            continue;
+        }
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            ++significant;
+            if (dots) --exponent;
+        } else {
+            truncated = true;
+        }
+    }
+    if (!digits) return false;
+
+    if (!truncated && mantissa <= (uint64_t(1) << 53) && exponent >= -22 &&
+        exponent <= 22) {
+        double m = (double)mantissa;
+        value = exponent < 0 ? m / powersOfTen[-exponent]
+                             : m * powersOfTen[exponent];
+        return true;
+    }
+
+    char text[512];
+    size_t length = end - begin;
+    if (length < sizeof(text)) {
+        memcpy(text, begin, length);
+        text[length] = 0;
+        value = strtod(text, NULL);
+    } else {
+        value = strtod(string(begin, end).c_str(), NULL);
     }
+    return true;
+}
+
+// returnNextTokenFromInput - return next token form the session input
+static int returnNextTokenFromInput() {
+    lexBuffer& B = lexBuf;
+    while (true) {
+        // delete the whitespace
+        B.tokStart = B.cur = skipSpaces(B.cur, B.end);
+        // process EOF
+        if (B.cur == B.end) {
+            if (!refillLexBuffer()) return tokEof;
+            continue;
+        }
+
+        unsigned char c = *B.cur;
+        if (charClasses[c] & ccAlpha) {
+            // identifier of source
+            B.cur = scanRun(B.cur + 1, scanIdentifier);
+            identifierStr.assign(B.tokStart, B.cur);
+            return keywordToken(identifierStr.data(), identifierStr.size());
+        }
+
+        if (charClasses[c] & ccNumber) {
+            // digit of source
+            B.cur = scanRun(B.cur + 1, scanNumber);
+            // a letter after the digits, as in 1e308 or 12abc, makes the
+            // whole run one malformed literal rather than a number and a name
+            bool trailing = false;
+            while (B.cur != B.end &&
+                   (charClasses[(unsigned char)*B.cur] & ccAlpha)) {
+                trailing = true;
+                B.cur = scanRun(scanRun(B.cur, scanIdentifier), scanNumber);
+            }
+            if (!trailing &&
+                parseNumberLiteral(B.tokStart, B.cur, numValue))
+                return tokNum;
+
+            char message[96];
+            snprintf(message, sizeof(message),
+                     "malformed number literal '%.*s'",
+                     (int)min<ptrdiff_t>(B.cur - B.tokStart, 64), B.tokStart);
+            logError(message);
+            return tokError;
+        }
 
-    // process EOF
-    if (lastChar == EOF) return tokEof;
-    int retChar = lastChar;
-    lastChar = getchar();
-    return retChar;
+        if (c == '#') {
+            // process comment, the line end itself is whitespace
+            B.cur = scanRun(B.cur + 1, findLineEnd);
+            continue;
+        }
+
+        ++B.cur;
+        return c;
+    }
 }
 
 /**
@@ -136,11 +548,43 @@ static int returnNextTokenFromInput() {
  *   * 目前没有进行作用域限制.
  * !}
  */
+// astKind - what an exprAST node is; also the tag in front of every
+// serialized node (see astWriter)
+enum astKind : uint8_t {
+    astNumber,
+    astVariable,
+    astBinary,
+    astCall,
+    astIf,
+    astFor,
+    astVar,
+    astIndex,
+};
+
+// valueType - the type of a value; arrays are host buffers of doubles passed
+// by pointer, a vec is as many doubles as fit in the widest vector register
+// of the host (4 or 8), operated on in parallel. Comparisons produce bools.
+enum valueType : uint8_t {
+    tyDouble,
+    tyDoubleArray,
+    tyVec,
+    tyI64,
+    tyBool,
+};
+
 // exprAST - Base class for all expression nodes on AST
 class exprAST {
    public:
     virtual ~exprAST() = default;
+    virtual astKind getKind() const = 0;
     virtual Value* codegen() = 0;
+    // markTailPosition - the value of this expression is what the enclosing
+    // function returns, so a call producing it can be a tail call
+    virtual void markTailPosition() {}
+    // visitChildren - call visit on every direct subexpression
+    virtual void visitChildren(function_ref<void(exprAST&)>) {}
+    // serialize - append the binary form of this subtree, see astReader
+    virtual void serialize(astWriter& W) const = 0;
 };
 
 // numExprAST - Expression class for numeric literals like "0.1"
@@ -150,7 +594,10 @@ class numExprAST : public exprAST {
 
    public:
     numExprAST(double value) : Val(value) {}
+    astKind getKind() const override { return astNumber; }
+    double getValue() const { return Val; }
     Value* codegen() override;
+    void serialize(astWriter& W) const override;
 };
 
 // variableExprAST - Expression class for referencing a variable, like "a" of
@@ -161,10 +608,39 @@ class variableExprAST : public exprAST {
 
    public:
     variableExprAST(const string& varName) : name(varName) {}
+    astKind getKind() const override { return astVariable; }
+    const string& getName() const { return name; }
     Value* codegen() override;
+    void serialize(astWriter& W) const override;
 };
 
-// binaryExprAST - Expression class of a binary operator.
+// indexExprAST - Expression class for an array element, like "a[i]"
+class indexExprAST : public exprAST {
+   private:
+    string name;
+    unique_ptr<exprAST> index;
+
+   public:
+    indexExprAST(const string& arrayName, unique_ptr<exprAST> elementIndex)
+        : name(arrayName), index(move(elementIndex)) {}
+    astKind getKind() const override { return astIndex; }
+    // an element of an array, or a lane of a vec
+    Value* codegen() override;
+    // codegenAssign - store the value of rhs to the element or lane
+    Value* codegenAssign(exprAST& rhs);
+    void visitChildren(function_ref<void(exprAST&)> visit) override {
+        visit(*index);
+    }
+    void serialize(astWriter& W) const override;
+
+   private:
+    Value* codegenAddress(AllocaInst* array);
+};
+
+// binaryExprAST - Expression class of a binary operator. Generated sources
+// chain hundreds of thousands of them, so everything that walks a chain of
+// binary operators (codegen, serialize, the destructor) does so with an
+// explicit stack instead of recursing once per operator.
 class binaryExprAST : public exprAST {
    private:
     char op;
@@ -174,45 +650,235 @@ class binaryExprAST : public exprAST {
     binaryExprAST(char astOp, unique_ptr<exprAST> astLHS,
                   unique_ptr<exprAST> astRHS)
         : op(astOp), LHS(move(astLHS)), RHS(move(astRHS)) {}
+    ~binaryExprAST() override;
+    astKind getKind() const override { return astBinary; }
+    char getOp() const { return op; }
+    exprAST& getLHS() const { return *LHS; }
+    exprAST& getRHS() const { return *RHS; }
     Value* codegen() override;
+    void markTailPosition() override;
+    void visitChildren(function_ref<void(exprAST&)> visit) override {
+        visit(*LHS);
+        visit(*RHS);
+    }
+    void serialize(astWriter& W) const override;
+
+   private:
+    Value* codegenAssign();
+    Value* codegenOperator(Value* L, Value* R);
 };
 
+// isOperatorChain - whether E is a binary operator whose operands the
+// iterative walks of binaryExprAST take apart themselves
+static bool isOperatorChain(const exprAST* E) {
+    return E && E->getKind() == astBinary;
+}
+
+binaryExprAST::~binaryExprAST() {
+    if (!isOperatorChain(LHS.get()) && !isOperatorChain(RHS.get())) return;
+    // detach the operands of nested operators before they are destroyed, so
+    // none of their destructors has anything left to recurse into
+    vector<unique_ptr<exprAST>> pending;
+    pending.push_back(move(LHS));
+    pending.push_back(move(RHS));
+    while (!pending.empty()) {
+        unique_ptr<exprAST> E = move(pending.back());
+        pending.pop_back();
+        if (isOperatorChain(E.get())) {
+            auto& B = static_cast<binaryExprAST&>(*E);
+            pending.push_back(move(B.LHS));
+            pending.push_back(move(B.RHS));
+        }
+    }
+}
+
+void binaryExprAST::markTailPosition() {
+    // the tail of a ':' sequence is the tail of its right hand side
+    binaryExprAST* B = this;
+    while (B->op == ':' && B->RHS->getKind() == astBinary)
+        B = static_cast<binaryExprAST*>(B->RHS.get());
+    if (B->op == ':') B->RHS->markTailPosition();
+}
+
+// forEachNode - call visit on root and every expression below it, parents
+// before children, until visit returns false. Uses an explicit stack, so it
+// is safe on arbitrarily deep trees.
+static void forEachNode(exprAST& root, function_ref<bool(exprAST&)> visit) {
+    vector<exprAST*> pending{&root};
+    while (!pending.empty()) {
+        exprAST* E = pending.back();
+        pending.pop_back();
+        if (!visit(*E)) return;
+        size_t first = pending.size();
+        E->visitChildren([&](exprAST& child) { pending.push_back(&child); });
+        reverse(pending.begin() + first, pending.end());  // left to right
+    }
+}
+
 // callExprAST - Expression class for function calls
 class callExprAST : public exprAST {
    private:
     string callee;
     vector<unique_ptr<exprAST>> args;
+    bool isTail = false;
 
    public:
     callExprAST(const string& funcCallee, vector<unique_ptr<exprAST>> funcArgs)
         : callee(funcCallee), args(move(funcArgs)) {}
+    astKind getKind() const override { return astCall; }
+    const string& getCallee() const { return callee; }
+    size_t getArgCount() const { return args.size(); }
+    Value* codegen() override;
+    void markTailPosition() override { isTail = true; }
+
+   private:
+    Value* codegenMathBuiltin(Intrinsic::ID id);
+    Value* codegenVectorBuiltin();
+    Value* codegenParallelBuiltin();
+
+   public:
+    void visitChildren(function_ref<void(exprAST&)> visit) override {
+        for (auto& arg : args) visit(*arg);
+    }
+    void serialize(astWriter& W) const override;
+};
+
+// ifExprAST - Expression class for if/then/else
+class ifExprAST : public exprAST {
+   private:
+    unique_ptr<exprAST> cond, then, otherwise;
+
+   public:
+    ifExprAST(unique_ptr<exprAST> ifCond, unique_ptr<exprAST> ifThen,
+              unique_ptr<exprAST> ifElse)
+        : cond(move(ifCond)), then(move(ifThen)), otherwise(move(ifElse)) {}
+    astKind getKind() const override { return astIf; }
+    Value* codegen() override;
+    void markTailPosition() override {
+        then->markTailPosition();
+        otherwise->markTailPosition();
+    }
+    void visitChildren(function_ref<void(exprAST&)> visit) override {
+        visit(*cond);
+        visit(*then);
+        visit(*otherwise);
+    }
+    void serialize(astWriter& W) const override;
+};
+
+// forExprAST - Expression class for for/in, the value is always 0.0
+class forExprAST : public exprAST {
+   private:
+    string varName;
+    valueType varType;  // double or i64
+    unique_ptr<exprAST> start, end, step, body;  // step may be null
+
+   public:
+    forExprAST(const string& forVar, valueType forVarType,
+               unique_ptr<exprAST> forStart, unique_ptr<exprAST> forEnd,
+               unique_ptr<exprAST> forStep, unique_ptr<exprAST> forBody)
+        : varName(forVar),
+          varType(forVarType),
+          start(move(forStart)),
+          end(move(forEnd)),
+          step(move(forStep)),
+          body(move(forBody)) {}
+    astKind getKind() const override { return astFor; }
+    Value* codegen() override;
+    void visitChildren(function_ref<void(exprAST&)> visit) override {
+        visit(*start);
+        visit(*end);
+        if (step) visit(*step);
+        visit(*body);
+    }
+    void serialize(astWriter& W) const override;
+
+   private:
+    bool isCountedLoop() const;
+};
+
+// varBinding - one variable of a var/in; unless a type is declared it has
+// the type of its initializer, and no initializer means a zero
+struct varBinding {
+    string name;
+    unique_ptr<exprAST> init;  // may be null
+    bool declared = false;
+    valueType type = tyDouble;
+};
+
+// varExprAST - Expression class for var/in
+class varExprAST : public exprAST {
+   private:
+    vector<varBinding> varNames;
+    unique_ptr<exprAST> body;
+
+   public:
+    varExprAST(vector<varBinding> vars, unique_ptr<exprAST> varBody)
+        : varNames(move(vars)), body(move(varBody)) {}
+    astKind getKind() const override { return astVar; }
+    const vector<varBinding>& getVars() const { return varNames; }
     Value* codegen() override;
+    void markTailPosition() override { body->markTailPosition(); }
+    void visitChildren(function_ref<void(exprAST&)> visit) override {
+        for (auto& var : varNames)
+            if (var.init) visit(*var.init);
+        visit(*body);
+    }
+    void serialize(astWriter& W) const override;
 };
+
 // prototypeAST - Represents the "prototype" for a function,
 // which captures its name, and its argument names(thus implicitly the number of
-// arguments the function takes)
+// arguments the function takes) and their types
 class prototypeAST {
    private:
     string name;
     vector<string> args;
+    vector<valueType> argTypes;
+    valueType retType;
 
    public:
-    prototypeAST(const string& Name, vector<string> Args)
-        : name(move(Name)), args(move(Args)) {}
+    prototypeAST(const string& Name, vector<string> Args,
+                 vector<valueType> ArgTypes, valueType RetType = tyDouble)
+        : name(move(Name)),
+          args(move(Args)),
+          argTypes(move(ArgTypes)),
+          retType(RetType) {}
     Function* codegen();
+    void serialize(astWriter& W) const;
     const string& getName() const { return name; }
+    const vector<valueType>& getArgTypes() const { return argTypes; }
+    valueType getRetType() const { return retType; }
+    // footprint - bytes the prototype holds, for --mem-report
+    size_t footprint() const {
+        size_t bytes = sizeof(*this) + name.capacity() +
+                       args.capacity() * sizeof(string) +
+                       argTypes.capacity() * sizeof(valueType);
+        for (auto& arg : args) bytes += arg.capacity();
+        return bytes;
+    }
 };
 
-// functionAST - represents a function definition itself
+// functionAST - represents a function definition itself; a memo def looks
+// its arguments up in a table of earlier results before running the body
 class functionAST {
    private:
     unique_ptr<prototypeAST> prototype;
     unique_ptr<exprAST> body;
+    bool memo;
 
    public:
-    functionAST(unique_ptr<prototypeAST> proto, unique_ptr<exprAST> bod)
-        : prototype(move(proto)), body(move(bod)) {}
+    functionAST(unique_ptr<prototypeAST> proto, unique_ptr<exprAST> bod,
+                bool isMemo = false)
+        : prototype(move(proto)), body(move(bod)), memo(isMemo) {}
+    // the prototype is handed to functionProtos by codegen
+    const prototypeAST& getPrototype() const { return *prototype; }
+    exprAST& getBody() { return *body; }
+    bool isMemo() const { return memo; }
+    // isPure - whether the body only calls pure functions, see findImpurity
+    bool isPure() const;
     Function* codegen();
+    void serialize(astWriter& W) const;
 };
 
 /**
@@ -221,10 +887,10 @@ class functionAST {
  * TODO : NULL
  */
 // bin op precedence  - holds the precedence for each binary operator.
-static map<char, int> BinOpPrecedence;
+static thread_local map<char, int> BinOpPrecedence;
 
 // curTok/getNextToken - provide a simpile token buffer.
-static int curTok;  // CurTok is the current token the parser is looking at.
+static thread_local int curTok;  // the current token the parser is looking at.
 static int getNextToken() {
     return curTok = returnNextTokenFromInput();
 }  // getNextToken reads another token form the lexer and updates CurTok with
@@ -235,14 +901,20 @@ static int getTokPrecedence() {
     if (!isascii(curTok)) return -1;
 
     // make sure it is a declared binary operator
-    int tokPrec = BinOpPrecedence[curTok];
-    if (tokPrec <= 0) return -1;
-    return tokPrec;
+    auto it = BinOpPrecedence.find(curTok);
+    if (it == BinOpPrecedence.end() || it->second <= 0) return -1;
+    return it->second;
 }
 
 // logError - help function for error handling
+static thread_local unsigned errorCount;  // errors reported by this session
+static thread_local bool parsingItem;     // errors are syntax errors
 unique_ptr<exprAST> logError(const char* Str) {
-    fprintf(stderr, "logError:%s\n", Str);
+    ++errorCount;
+    if (parsingItem)
+        fprintf(sessionOut, "logError:line %u: %s\n", lexLine(), Str);
+    else
+        fprintf(sessionOut, "logError:%s\n", Str);
     return NULL;
 }
 unique_ptr<prototypeAST> prototypeError(const char* Str) {
@@ -250,12 +922,56 @@ unique_ptr<prototypeAST> prototypeError(const char* Str) {
     return NULL;
 }
 
-// base expression
+// expression ::= operand (binop operand)*
+// operand ::= primary | '(' expression ')'
+// Operator precedence parsing with explicit operand and operator stacks
+// (shunting-yard), so nesting by operators or parentheses costs heap rather
+// than native stack. Operators of equal precedence associate to the left.
 static unique_ptr<exprAST> parseExpression() {
-    auto LHS = parsePrimay();
-    if (!LHS) return NULL;
+    struct pendingOp {
+        int op;  // the operator, or '(' for an open parenthesis
+        int prec;
+    };
+    vector<unique_ptr<exprAST>> operands;
+    vector<pendingOp> operators;
+    size_t openParens = 0;
+
+    // reduce - merge the top two operands with the top operator
+    auto reduce = [&] {
+        auto RHS = move(operands.back());
+        operands.pop_back();
+        operands.back() = make_unique<binaryExprAST>(
+            operators.back().op, move(operands.back()), move(RHS));
+        operators.pop_back();
+    };
+
+    while (true) {
+        for (; curTok == '('; getNextToken()) {
+            operators.push_back({'(', 0});
+            ++openParens;
+        }
+        auto operand = parsePrimay();
+        if (!operand) return NULL;
+        operands.push_back(move(operand));
+
+        for (; openParens && curTok == ')'; getNextToken()) {
+            while (operators.back().op != '(') reduce();
+            operators.pop_back();
+            --openParens;
+        }
+
+        int tokPrec = getTokPrecedence();
+        if (tokPrec < 0) break;
+        while (!operators.empty() && operators.back().op != '(' &&
+               operators.back().prec >= tokPrec)
+            reduce();
+        operators.push_back({curTok, tokPrec});
+        getNextToken();
+    }
+    if (openParens) return logError("expected ')'");
 
-    return parseBinaryOperatorRHS(0, move(LHS));
+    while (!operators.empty()) reduce();
+    return move(operands.back());
 }
 
 // number expression
@@ -265,24 +981,22 @@ static unique_ptr<exprAST> parseNumberExpr() {
     return move(result);
 }
 
-// paren expression
-static unique_ptr<exprAST> parseParenExpr() {
-    getNextToken();  // eat (
-    auto V = parseExpression();
-
-    if (!V) return NULL;
-
-    if (curTok != ')') return logError("expected ')'");
-    getNextToken();  // eat )
-    return V;
-}
-
 // identifier
 static unique_ptr<exprAST> parseIdentifierExpr() {
     string idName = identifierStr;
 
     getNextToken();
 
+    if (curTok == '[') {
+        // array element
+        getNextToken();  // eat [
+        auto index = parseExpression();
+        if (!index) return NULL;
+        if (curTok != ']') return logError("expected ']' after array index");
+        getNextToken();  // eat ]
+        return make_unique<indexExprAST>(idName, move(index));
+    }
+
     if (curTok != '(') return make_unique<variableExprAST>(idName);
 
     // call
@@ -305,49 +1019,167 @@ static unique_ptr<exprAST> parseIdentifierExpr() {
     getNextToken();
     return make_unique<callExprAST>(idName, move(args));
 }
+// ifexpr ::= 'if' expression 'then' expression 'else' expression
+static unique_ptr<exprAST> parseIfExpr() {
+    getNextToken();  // eat if
+
+    auto cond = parseExpression();
+    if (!cond) return NULL;
+
+    if (curTok != tokThen) return logError("expected then");
+    getNextToken();  // eat then
+
+    auto then = parseExpression();
+    if (!then) return NULL;
+
+    if (curTok != tokElse) return logError("expected else");
+    getNextToken();  // eat else
+
+    auto otherwise = parseExpression();
+    if (!otherwise) return NULL;
+
+    return make_unique<ifExprAST>(move(cond), move(then), move(otherwise));
+}
+
+// forexpr ::= 'for' identifier [':' type] '=' expr ',' expr [',' expr]
+//             'in' expression
+static unique_ptr<exprAST> parseForExpr() {
+    getNextToken();  // eat for
+
+    if (curTok != tokIdentifier)
+        return logError("expected identifier after for");
+    string varName = identifierStr;
+    getNextToken();  // eat identifier
+
+    valueType varType = tyDouble;
+    if (curTok == ':') {
+        getNextToken();  // eat :
+        if (!parseType(varType)) return NULL;
+        if (varType != tyDouble && varType != tyI64)
+            return logError("loop variable must be a double or an i64");
+    }
+
+    if (curTok != '=') return logError("expected '=' after for");
+    getNextToken();  // eat =
+
+    auto start = parseExpression();
+    if (!start) return NULL;
+    if (curTok != ',') return logError("expected ',' after for start value");
+    getNextToken();
+
+    auto end = parseExpression();
+    if (!end) return NULL;
+
+    // the step value is optional
+    unique_ptr<exprAST> step;
+    if (curTok == ',') {
+        getNextToken();
+        step = parseExpression();
+        if (!step) return NULL;
+    }
+
+    if (curTok != tokIn) return logError("expected 'in' after for");
+    getNextToken();  // eat in
+
+    auto body = parseExpression();
+    if (!body) return NULL;
+
+    return make_unique<forExprAST>(varName, varType, move(start), move(end),
+                                   move(step), move(body));
+}
+
+// varexpr ::= 'var' binding (',' binding)* 'in' expression
+// binding ::= identifier [':' type] ['=' expression]
+static unique_ptr<exprAST> parseVarExpr() {
+    getNextToken();  // eat var
+
+    vector<varBinding> varNames;
+    if (curTok != tokIdentifier) return logError("expected identifier after var");
+
+    while (true) {
+        varBinding var;
+        var.name = identifierStr;
+        getNextToken();  // eat identifier
+
+        // the type and the initializer are optional
+        if (curTok == ':') {
+            getNextToken();  // eat :
+            if (!parseType(var.type)) return NULL;
+            var.declared = true;
+        }
+        if (curTok == '=') {
+            getNextToken();  // eat =
+            var.init = parseExpression();
+            if (!var.init) return NULL;
+        }
+        varNames.push_back(move(var));
+
+        if (curTok != ',') break;
+        getNextToken();  // eat ,
+        if (curTok != tokIdentifier)
+            return logError("expected identifier list after var");
+    }
+
+    if (curTok != tokIn) return logError("expected 'in' keyword after 'var'");
+    getNextToken();  // eat in
+
+    auto body = parseExpression();
+    if (!body) return NULL;
+
+    return make_unique<varExprAST>(move(varNames), move(body));
+}
+
 // primary
-// identifier,numberexpr,parenexpr
+// identifier,numberexpr,ifexpr,forexpr,varexpr; parentheses are taken care
+// of by parseExpression
 static unique_ptr<exprAST> parsePrimay() {
     switch (curTok) {
         case tokIdentifier:
             return parseIdentifierExpr();
         case tokNum:
             return parseNumberExpr();
-        case '(':
-            return parseParenExpr();
+        case tokIf:
+            return parseIfExpr();
+        case tokFor:
+            return parseForExpr();
+        case tokVar:
+            return parseVarExpr();
+        case tokError:
+            return NULL;  // already reported by the lexer
         default:
             return logError("unkown token when expecting an expression");
     }
 }
 
-// binary Operator
-static unique_ptr<exprAST> parseBinaryOperatorRHS(int exprPrec,
-                                                  unique_ptr<exprAST> LHS) {
-    // if is a binary operator, find its precedence.
-    while (1) {
-        int tokPrec = getTokPrecedence();
-
-        if (tokPrec < exprPrec) return LHS;
-
-        int binOp = curTok;
-        getNextToken();
-
-        auto RHS = parsePrimay();
-        if (!RHS) return NULL;
-
-        int nextPrec = getTokPrecedence();
-        if (tokPrec < nextPrec) {
-            // // TODO : create AST node for a_b expresson
-            RHS = parseBinaryOperatorRHS(tokPrec + 1, move(RHS));
-            if (!RHS) return NULL;
+// type ::= 'double' ['[' ']'] | 'vec' | 'i64' | 'bool'
+static bool parseType(valueType& type) {
+    static const struct {
+        const char* name;
+        valueType type;
+    } scalarTypes[] = {{"vec", tyVec}, {"i64", tyI64}, {"bool", tyBool}};
+    for (auto& scalar : scalarTypes)
+        if (curTok == tokIdentifier && identifierStr == scalar.name) {
+            type = scalar.type;
+            getNextToken();  // eat the type name
+            return true;
         }
-
-        // Merge LHS/RHS
-        LHS = make_unique<binaryExprAST>(binOp, move(LHS), move(RHS));
+    if (curTok != tokIdentifier || identifierStr != "double") {
+        logError("expected a type name after ':'");
+        return false;
+    }
+    type = tyDouble;
+    if (getNextToken() == '[') {
+        if (getNextToken() != ']') {
+            logError("expected ']' in array type");
+            return false;
+        }
+        type = tyDoubleArray;
+        getNextToken();  // eat ]
     }
+    return true;
 }
 
-// prototype
+// prototype ::= identifier '(' (identifier [':' type])* ')' [':' type]
 static unique_ptr<prototypeAST> parsePrototype() {
     if (curTok != tokIdentifier)
         return prototypeError("expected function name in prototype");
@@ -356,25 +1188,44 @@ static unique_ptr<prototypeAST> parsePrototype() {
 
     if (curTok != '(') return prototypeError("expected '(' in prototype");
 
-    // read the list of argument names
+    // read the list of argument names, each with an optional ':type'
     vector<string> argNames;
-    while (getNextToken() == tokIdentifier) argNames.push_back(identifierStr);
+    vector<valueType> argTypes;
+    getNextToken();
+    while (curTok == tokIdentifier) {
+        argNames.push_back(identifierStr);
+        argTypes.push_back(tyDouble);
+        if (getNextToken() != ':') continue;
+        getNextToken();  // eat :
+        if (!parseType(argTypes.back())) return NULL;
+    }
     if (curTok != ')') return prototypeError("expected ')' int prototype");
 
-    // success
-    getNextToken();
+    // the result is a double unless declared otherwise
+    valueType retType = tyDouble;
+    if (getNextToken() == ':') {
+        getNextToken();  // eat :
+        if (!parseType(retType)) return NULL;
+    }
 
-    return make_unique<prototypeAST>(functionName, move(argNames));
+    // success
+    return make_unique<prototypeAST>(functionName, move(argNames),
+                                     move(argTypes), retType);
 }
 
-// def function
+// def function, or memo def
 static unique_ptr<functionAST> parseDefinition() {
+    bool memo = curTok == tokMemo;
+    if (memo && getNextToken() != tokDef) {
+        logError("expected 'def' after 'memo'");
+        return NULL;
+    }
     getNextToken();  // def identifier
     auto prototype = parsePrototype();
     if (!prototype) return NULL;
 
     if (auto EBody = parseExpression())
-        return make_unique<functionAST>(move(prototype), move(EBody));
+        return make_unique<functionAST>(move(prototype), move(EBody), memo);
     return NULL;
 }
 // extern definition
@@ -382,260 +1233,5228 @@ static unique_ptr<prototypeAST> parseExtern() {
     getNextToken();  // extern def
     return parsePrototype();
 }
+// forget ::= 'forget' identifier, the name of a def; empty on an error
+static string parseForget() {
+    if (getNextToken() != tokIdentifier) {
+        logError("expected function name after 'forget'");
+        return string();
+    }
+    string name = identifierStr;
+    getNextToken();  // eat identifier
+    return name;
+}
 
 // high level expression
 static unique_ptr<functionAST> parseTopLevelExpr() {
     if (auto EBody = parseExpression()) {
         auto prototype = make_unique<prototypeAST>(
-            "__anon_expr" /*anonymous function*/, vector<string>());
+            "__anon_expr" /*anonymous function*/, vector<string>(),
+            vector<valueType>());
         return make_unique<functionAST>(move(prototype), move(EBody));
     }
     return NULL;
 }
 
 /**
- * * 代码生成: AST to LLVM IR (codegen())
+ * * JIT 引擎
  * * Author: Amiriox
  * TODO : NULL
+ * ! remark:{
+ *   * jitEngine 是进程级别的, 所有会话共享同一个 ExecutionSession,
+ *   * 同一个目标文件缓存以及每个工作线程复用的 TargetMachine
+ *   * jvavJIT 是会话级别的, 每个会话拥有自己的 JITDylib (符号表)
+ * !}
  */
-static LLVMContext theContext;
-static IRBuilder<> builder(theContext);
-static unique_ptr<Module> theModule;
-static map<string, Value*> namedValues;
-static unique_ptr<legacy::FunctionPassManager> theFPM;
-static unique_ptr<KaleidoscopeJIT> theJIT;
-static map<string, unique_ptr<prototypeAST>> functionProtos;
+extern "C" double putchard(double X);
+extern "C" double printd(double X);
+static double parallelSum(double (*body)(int64_t), int64_t begin, int64_t end);
 
-Value* valueLogError(const char* str) {
-    logError(str);
-    return NULL;
-}
-Function* getFunction(string Name) {
-    // First, see if the function has already been added to the current module
-    if (auto* F = theModule->getFunction(Name)) return F;
+// memoEviction - what a memo table does with a result when every slot it
+// may go to is taken (--memo-evict)
+enum memoEviction : uint8_t {
+    evictLru,   // replace the least recently used of those slots
+    evictNone,  // keep the table as it is and do not remember the result
+    evictGrow,  // double the table
+};
+static size_t memoCapacity = 1 << 16;  // --memo-capacity, slots per table
+static memoEviction memoEvict = evictLru;
 
-    auto FI = functionProtos.find(Name);
-    if (FI != functionProtos.end()) return FI->second->codegen();
+// memoTable - the results of one memo def, keyed by the bits of its
+// arguments. Open addressing: a key lives within memoProbeWindow slots of its
+// hash, so a lookup never looks at more than that many slots. Locked, since
+// parfor may call the def from every thread of the work pool at once.
+class memoTable {
+   private:
+    static const unsigned memoProbeWindow = 8;
+    mutex lock;
+    unsigned arity;
+    size_t capacity;          // a power of two
+    vector<uint64_t> keys;    // arity words per slot
+    vector<uint64_t> values;  // result bits
+    vector<uint64_t> stamps;  // time of last use, 0 for an empty slot
+    uint64_t clock = 0;
+    size_t used = 0;
 
-    return NULL;
+    size_t home(const uint64_t* key) const {
+        uint64_t h = arity;
+        for (unsigned i = 0; i < arity; ++i)
+            h = (h ^ key[i]) * 0x9e3779b97f4a7c15ull;
+        return (h ^ (h >> 32)) & (capacity - 1);
+    }
+    bool holds(size_t slot, const uint64_t* key) const {
+        return !memcmp(&keys[slot * arity], key, arity * sizeof(uint64_t));
+    }
+    void put(size_t slot, const uint64_t* key, uint64_t value) {
+        if (!stamps[slot]) ++used;
+        memcpy(&keys[slot * arity], key, arity * sizeof(uint64_t));
+        values[slot] = value;
+        stamps[slot] = ++clock;
+    }
+    void resize(size_t slots) {
+        memoTable bigger(arity, slots);
+        for (size_t slot = 0; slot < capacity; ++slot)
+            if (stamps[slot]) bigger.insert(&keys[slot * arity], values[slot]);
+        swap(keys, bigger.keys);
+        swap(values, bigger.values);
+        swap(stamps, bigger.stamps);
+        capacity = slots;
+    }
+    void insert(const uint64_t* key, uint64_t value) {
+        if (memoEvict == evictGrow && used * 2 >= capacity) resize(capacity * 2);
+        size_t slot = home(key), victim = slot;
+        for (unsigned probe = 0; probe < memoProbeWindow; ++probe) {
+            if (!stamps[slot] || holds(slot, key)) return put(slot, key, value);
+            if (stamps[slot] < stamps[victim]) victim = slot;
+            slot = (slot + 1) & (capacity - 1);
+        }
+        switch (memoEvict) {
+            case evictNone:
+                return;
+            case evictGrow:
+                resize(capacity * 2);
+                return insert(key, value);
+            case evictLru:
+                return put(victim, key, value);
+        }
+    }
+
+   public:
+    memoTable(unsigned n, size_t slots)
+        : arity(n),
+          capacity(max<size_t>(PowerOf2Ceil(slots), memoProbeWindow)),
+          keys(capacity * n),
+          values(capacity),
+          stamps(capacity) {}
+
+    bool lookup(const uint64_t* key, uint64_t& value) {
+        lock_guard<mutex> guard(lock);
+        size_t slot = home(key);
+        for (unsigned probe = 0; probe < memoProbeWindow; ++probe) {
+            // nothing is ever removed, so an empty slot ends the search
+            if (!stamps[slot]) return false;
+            if (holds(slot, key)) {
+                value = values[slot];
+                stamps[slot] = ++clock;
+                return true;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+        return false;
+    }
+    void store(const uint64_t* key, uint64_t value) {
+        lock_guard<mutex> guard(lock);
+        insert(key, value);
+    }
+    // bytes - what the table holds, for --mem-report
+    size_t bytes() {
+        lock_guard<mutex> guard(lock);
+        return sizeof(*this) + (keys.capacity() + values.capacity() +
+                                stamps.capacity()) * sizeof(uint64_t);
+    }
+};
+
+// memoLookup/memoStore - the memo table calls generated for a memo def
+static int memoLookup(memoTable* table, const uint64_t* key, uint64_t* value) {
+    return table->lookup(key, *value);
 }
-Value* numExprAST::codegen() {
-    return ConstantFP::get(theContext, APFloat(Val));
+static void memoStore(memoTable* table, const uint64_t* key, uint64_t value) {
+    table->store(key, value);
+}
+// memoTableSymbol - the name the code of a memo def refers to its table by;
+// the table's address is bound to it when the code is linked, so the object
+// code holds no address of the process that compiled it
+static string memoTableSymbol(const string& def) {
+    return "__jvav_memo." + def;
 }
 
-Value* variableExprAST::codegen() {
-    Value* V = namedValues[name];
-    if (!V) valueLogError("use of undeclared identifier");
-    return V;
+// runtimeBuiltins - host functions every session can call without having
+// them exported from the executable
+static const struct {
+    const char* name;
+    void* address;
+} runtimeBuiltins[] = {
+    {"putchard", (void*)&putchard},
+    {"printd", (void*)&printd},
+    {"__jvav_memo_lookup", (void*)&memoLookup},
+    {"__jvav_memo_store", (void*)&memoStore},
+    {"__jvav_parallel_sum", (void*)&parallelSum},
+};
+
+// isRuntimeBuiltin - whether name is one of runtimeBuiltins
+static bool isRuntimeBuiltin(StringRef name) {
+    for (auto& B : runtimeBuiltins)
+        if (name == B.name) return true;
+    return false;
 }
 
-Value* binaryExprAST::codegen() {
-    Value* L = LHS->codegen();
-    Value* R = RHS->codegen();
-    if (!L || !R) {
-        return NULL;
-    }
+// jitMemory - process wide home of the sections the JIT loads. The code and
+// read-only data of an object share one span of pages, made read+execute
+// when the object is finalized, instead of a mapping per section kind; the
+// writable data of all objects is packed into shared slabs, each unmapped
+// once nothing in it is live. The counters feed --mem-report.
+class jitMemory {
+   public:
+    struct slab {
+        sys::MemoryBlock block;
+        size_t used = 0;  // bump pointer
+        size_t live = 0;  // bytes of the sections still loaded
+    };
+    struct counters {
+        atomic<size_t> objects{0};
+        atomic<size_t> spanBytes{0}, spanUsed{0};  // code and constants
+        atomic<size_t> slabBytes{0}, slabUsed{0};  // writable data
+    } stats;
 
+   private:
+    static const size_t slabSize = 64 << 10;
+    mutex lock;
+    slab* current = NULL;  // the slab small sections are packed into
+
+    slab* mapSlab(size_t size) {
+        error_code EC;
+        auto block = sys::Memory::allocateMappedMemory(
+            size, NULL, sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+        if (EC) return NULL;
+        slab* S = new slab;
+        S->block = block;
+        stats.slabBytes += block.allocatedSize();
+        return S;
+    }
+    void unmapSlab(slab* S) {
+        stats.slabBytes -= S->block.allocatedSize();
+        sys::Memory::releaseMappedMemory(S->block);
+        delete S;
+    }
+
+   public:
+    ~jitMemory() {
+        if (current) unmapSlab(current);
+    }
+
+    sys::MemoryBlock mapSpan(size_t size) {
+        error_code EC;
+        auto block = sys::Memory::allocateMappedMemory(
+            size, NULL, sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+        if (EC) return sys::MemoryBlock();
+        stats.spanBytes += block.allocatedSize();
+        return block;
+    }
+    void unmapSpan(sys::MemoryBlock& block) {
+        stats.spanBytes -= block.allocatedSize();
+        sys::Memory::releaseMappedMemory(block);
+    }
+
+    // allocateData - size bytes of writable data; sections too big to pack
+    // get a slab of their own
+    uint8_t* allocateData(size_t size, unsigned align, slab*& owner) {
+        lock_guard<mutex> guard(lock);
+        if (size > slabSize / 4) {
+            owner = mapSlab(size);
+        } else {
+            if (!current || alignTo(current->used, align) + size >
+                                current->block.allocatedSize()) {
+                slab* full = current;
+                current = mapSlab(slabSize);
+                if (full && !full->live) unmapSlab(full);
+            }
+            owner = current;
+        }
+        if (!owner) return NULL;
+        size_t offset = alignTo(owner->used, align);
+        owner->used = offset + size;
+        owner->live += size;
+        stats.slabUsed += size;
+        return (uint8_t*)owner->block.base() + offset;
+    }
+    void releaseData(slab* owner, size_t size) {
+        lock_guard<mutex> guard(lock);
+        stats.slabUsed -= size;
+        if (!(owner->live -= size) && owner != current) unmapSlab(owner);
+    }
+};
+
+// pooledMemoryManager - RuntimeDyld memory manager of one loaded object, its
+// sections come from jitMemory and go back to it when the object is removed
+class pooledMemoryManager : public RTDyldMemoryManager {
+   private:
+    jitMemory& memory;
+    vector<sys::MemoryBlock> spans;  // code and read-only data
+    size_t spanUsed = 0;             // of spans.back()
+    size_t spanBytes = 0;            // of all spans, handed out
+    vector<pair<jitMemory::slab*, size_t>> data;  // writable sections
+
+    uint8_t* allocateInSpan(uintptr_t size, unsigned align) {
+        size_t offset = spans.empty() ? 0 : alignTo(spanUsed, align);
+        if (spans.empty() || offset + size > spans.back().allocatedSize()) {
+            // more than RuntimeDyld reserved; a fresh span is page aligned
+            auto span = memory.mapSpan(max<size_t>(size, 1));
+            if (!span.base()) return NULL;
+            spans.push_back(span);
+            offset = 0;
+        }
+        spanUsed = offset + size;
+        spanBytes += size;
+        memory.stats.spanUsed += size;
+        return (uint8_t*)spans.back().base() + offset;
+    }
+
+   public:
+    explicit pooledMemoryManager(jitMemory& mem) : memory(mem) {
+        ++memory.stats.objects;
+    }
+    ~pooledMemoryManager() override {
+        for (auto& span : spans) memory.unmapSpan(span);
+        memory.stats.spanUsed -= spanBytes;
+        for (auto& section : data)
+            memory.releaseData(section.first, section.second);
+        --memory.stats.objects;
+    }
+
+    bool needsToReserveAllocationSpace() override { return true; }
+    void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign,
+                                uintptr_t RODataSize, uint32_t RODataAlign,
+                                uintptr_t, uint32_t) override {
+        if (!CodeSize && !RODataSize) return;
+        auto span = memory.mapSpan(CodeSize + CodeAlign + RODataSize +
+                                   RODataAlign);
+        if (span.base()) spans.push_back(span);
+    }
+    uint8_t* allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned,
+                                 StringRef) override {
+        return allocateInSpan(Size, Alignment);
+    }
+    uint8_t* allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned,
+                                 StringRef, bool IsReadOnly) override {
+        if (IsReadOnly) return allocateInSpan(Size, Alignment);
+        jitMemory::slab* owner;
+        uint8_t* section = memory.allocateData(Size, Alignment, owner);
+        if (section) data.emplace_back(owner, Size);
+        return section;
+    }
+    bool finalizeMemory(string* ErrMsg) override {
+        for (auto& span : spans) {
+            if (auto EC = sys::Memory::protectMappedMemory(
+                    span, sys::Memory::MF_READ | sys::Memory::MF_EXEC)) {
+                if (ErrMsg) *ErrMsg = EC.message();
+                return true;
+            }
+            sys::Memory::InvalidateInstructionCache(span.base(),
+                                                    span.allocatedSize());
+        }
+        return false;
+    }
+};
+
+static size_t objectCacheLimit = 64 << 20;  // --object-cache-size, bytes
+
+// objectCache - compiled objects keyed by a hash of the module IR, shared by
+// all sessions so identical definitions are only ever compiled once. The
+// least recently used objects are dropped beyond objectCacheLimit bytes.
+class objectCache {
+   private:
+    struct entry {
+        unique_ptr<MemoryBuffer> object;
+        list<uint64_t>::iterator use;
+    };
+    mutex lock;
+    map<uint64_t, entry> objects;
+    list<uint64_t> recency;  // keys, most recently used first
+    size_t bytes = 0;
+    atomic<uint64_t> hits{0}, misses{0};
+
+   public:
+    unique_ptr<MemoryBuffer> lookup(uint64_t key) {
+        lock_guard<mutex> guard(lock);
+        auto it = objects.find(key);
+        if (it == objects.end()) {
+            ++misses;
+            return NULL;
+        }
+        ++hits;
+        recency.splice(recency.begin(), recency, it->second.use);
+        auto& obj = *it->second.object;
+        return MemoryBuffer::getMemBufferCopy(obj.getBuffer(),
+                                              obj.getBufferIdentifier());
+    }
+    void insert(uint64_t key, const MemoryBuffer& obj) {
+        lock_guard<mutex> guard(lock);
+        auto& E = objects[key];
+        if (E.object) {
+            bytes -= E.object->getBufferSize();
+            recency.erase(E.use);
+        }
+        E.object = MemoryBuffer::getMemBufferCopy(obj.getBuffer(),
+                                                  obj.getBufferIdentifier());
+        E.use = recency.insert(recency.begin(), key);
+        bytes += E.object->getBufferSize();
+        while (bytes > objectCacheLimit) {
+            auto oldest = objects.find(recency.back());
+            bytes -= oldest->second.object->getBufferSize();
+            objects.erase(oldest);
+            recency.pop_back();
+        }
+    }
+    uint64_t getHits() const { return hits; }
+    uint64_t getMisses() const { return misses; }
+    size_t getEntries() {
+        lock_guard<mutex> guard(lock);
+        return objects.size();
+    }
+    size_t getBytes() {
+        lock_guard<mutex> guard(lock);
+        return bytes;
+    }
+};
+
+// cachingCompiler - IR compiler that consults the object cache first and
+// otherwise compiles with a target machine owned by the calling thread
+class cachingCompiler : public IRCompileLayer::IRCompiler {
+   private:
+    static const size_t hugeModuleInstructions = 20000;
+    JITTargetMachineBuilder JTMB;
+    objectCache& cache;
+
+   public:
+    cachingCompiler(JITTargetMachineBuilder jtmb, objectCache& objCache)
+        : IRCompiler(irManglingOptionsFromTargetOptions(jtmb.getOptions())),
+          JTMB(move(jtmb)),
+          cache(objCache) {}
+
+    TargetMachine& getTargetMachine() {
+        static thread_local unique_ptr<TargetMachine> threadTM;
+        if (!threadTM) threadTM = cantFail(JTMB.createTargetMachine());
+        return *threadTM;
+    }
+
+    // codegenPipeline - the code generator passes of the thread's target
+    // machine, set up once per optimization level and then run on one module
+    // after another (what llc -run-twice checks), into the same buffer
+    struct codegenPipeline {
+        legacy::PassManager PM;
+        SmallVector<char, 0> object;
+        raw_svector_ostream stream{object};
+    };
+    codegenPipeline* getCodegen(TargetMachine& TM) {
+        static thread_local unique_ptr<codegenPipeline> pipelines[2];
+        auto& P = pipelines[TM.getOptLevel() == CodeGenOpt::None];
+        if (!P) {
+            P = make_unique<codegenPipeline>();
+            MCContext* ctx;
+            if (TM.addPassesToEmitMC(P->PM, ctx, P->stream)) P.reset();
+        }
+        return P.get();
+    }
+
+    Expected<unique_ptr<MemoryBuffer>> operator()(Module& M) override {
+        string ir;
+        raw_string_ostream irStream(ir);
+        M.print(irStream, NULL);
+        uint64_t key = xxHash64(irStream.str());
+
+        if (auto obj = cache.lookup(key)) return obj;
+
+        // instruction selection and scheduling are superlinear in the size of
+        // a basic block, so machine generated giants take the fast path
+        size_t instructions = 0;
+        for (auto& F : M) instructions += F.getInstructionCount();
+        TargetMachine& TM = getTargetMachine();
+        TM.setOptLevel(instructions > hugeModuleInstructions
+                           ? CodeGenOpt::None
+                           : CodeGenOpt::Aggressive);
+        codegenPipeline* codegen = getCodegen(TM);
+        if (!codegen)
+            return make_error<StringError>("the target cannot emit objects",
+                                           inconvertibleErrorCode());
+        codegen->PM.run(M);
+        auto obj = make_unique<SmallVectorMemoryBuffer>(
+            move(codegen->object), M.getModuleIdentifier());
+        codegen->object.clear();  // for the stream, which writes into it
+        cache.insert(key, *obj);
+        return obj;
+    }
+};
+
+// jitEngine - process wide ORC stack shared by every session
+class jitEngine {
+   private:
+    unique_ptr<ExecutionSession> ES;
+    DataLayout DL;
+    objectCache cache;
+    jitMemory memory;
+    RTDyldObjectLinkingLayer objectLayer;
+    IRCompileLayer compileLayer;
+    cachingCompiler* compiler;
+    unsigned vecWidth;
+    bool vectorMath;
+    // keptObjects - the object code of the defs that are to be kept, by the
+    // resource key of their tracker; filled in as they are linked, see :save
+    mutex keptLock;
+    map<ResourceKey, unique_ptr<MemoryBuffer>> keptObjects;
+
+    void keepEmitted(MaterializationResponsibility& R,
+                     unique_ptr<MemoryBuffer> obj) {
+        consumeError(R.withResourceKeyDo([&](ResourceKey K) {
+            lock_guard<mutex> guard(keptLock);
+            auto it = keptObjects.find(K);
+            if (it != keptObjects.end()) it->second = move(obj);
+        }));
+    }
+
+   public:
+    jitEngine(unique_ptr<ExecutionSession> es, JITTargetMachineBuilder JTMB,
+              DataLayout dl, unsigned width, bool vecMath)
+        : ES(move(es)),
+          DL(move(dl)),
+          objectLayer(*ES,
+                      [this]() {
+                          return make_unique<pooledMemoryManager>(memory);
+                      }),
+          compileLayer(*ES, objectLayer,
+                       make_unique<cachingCompiler>(move(JTMB), cache)),
+          vecWidth(width),
+          vectorMath(vecMath) {
+        compiler = static_cast<cachingCompiler*>(&compileLayer.getCompiler());
+        objectLayer.setNotifyEmitted([this](MaterializationResponsibility& R,
+                                            unique_ptr<MemoryBuffer> obj) {
+            keepEmitted(R, move(obj));
+        });
+    }
+    ~jitEngine() {
+        if (auto err = ES->endSession()) ES->reportError(move(err));
+    }
+
+    static unique_ptr<jitEngine> create() {
+        auto EPC = cantFail(SelfExecutorProcessControl::Create());
+        auto ES = make_unique<ExecutionSession>(move(EPC));
+        // the host CPU and its features, so the vectorizers can use them
+        auto JTMB = cantFail(JITTargetMachineBuilder::detectHost());
+        JTMB.setCodeGenOptLevel(CodeGenOpt::Aggressive);
+        auto DL = cantFail(JTMB.getDefaultDataLayoutForTarget());
+        // a vec fills a 512 bit register where there is one, else 256 bits
+        auto features = JTMB.getFeatures().getFeatures();
+        unsigned width =
+            find(features.begin(), features.end(), "+avx512f") != features.end()
+                ? 8
+                : 4;
+        // glibc's vector math functions, for sin and friends in loops
+        bool vecMath =
+            JTMB.getTargetTriple().isX86() &&
+            !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+        return make_unique<jitEngine>(move(ES), move(JTMB), move(DL), width,
+                                      vecMath);
+    }
+
+    ExecutionSession& getSession() { return *ES; }
+    const DataLayout& getDataLayout() const { return DL; }
+    IRCompileLayer& getCompileLayer() { return compileLayer; }
+    RTDyldObjectLinkingLayer& getObjectLayer() { return objectLayer; }
+    // compile - object code for M, through the object cache
+    Expected<unique_ptr<MemoryBuffer>> compile(Module& M) {
+        return (*compiler)(M);
+    }
+    TargetMachine& getTargetMachine() { return compiler->getTargetMachine(); }
+    objectCache& getCache() { return cache; }
+    jitMemory& getMemory() { return memory; }
+    unsigned getVecWidth() const { return vecWidth; }
+    bool hasVectorMath() const { return vectorMath; }
+
+    // keepObject/keptObject/dropObject - see keptObjects
+    void keepObject(ResourceKey K) {
+        lock_guard<mutex> guard(keptLock);
+        keptObjects[K];
+    }
+    bool keptObject(ResourceKey K, string& bytes) {
+        lock_guard<mutex> guard(keptLock);
+        auto it = keptObjects.find(K);
+        if (it == keptObjects.end() || !it->second) return false;
+        bytes = it->second->getBuffer().str();
+        return true;
+    }
+    void dropObject(ResourceKey K) {
+        lock_guard<mutex> guard(keptLock);
+        keptObjects.erase(K);
+    }
+    // keptBytes - what the kept objects hold, for --mem-report
+    size_t keptBytes(size_t& objects) {
+        lock_guard<mutex> guard(keptLock);
+        size_t bytes = 0;
+        objects = 0;
+        for (auto& kept : keptObjects)
+            if (kept.second) {
+                ++objects;
+                bytes += kept.second->getBufferSize();
+            }
+        return bytes;
+    }
+};
+
+// jvavJIT - one session's view of the engine: its own JITDylib, so symbols
+// defined by one client are invisible to every other client
+class jvavJIT {
+   private:
+    jitEngine& engine;
+    JITDylib& mainJD;
+    MangleAndInterner mangle;
+    set<ResourceKey> kept;  // trackers whose object code the engine keeps
+
+    // trackDefinition - the tracker of a def; the memo table, if any, goes
+    // away with its code
+    ResourceTrackerSP trackDefinition(const string& name, memoTable* table,
+                                      bool keep) {
+        auto RT = mainJD.createResourceTracker();
+        if (table) {
+            SymbolMap symbols;
+            symbols[mangle(memoTableSymbol(name))] = JITEvaluatedSymbol(
+                pointerToJITTargetAddress(table), JITSymbolFlags::Exported);
+            cantFail(mainJD.define(absoluteSymbols(move(symbols)), RT));
+        }
+        if (keep) {
+            kept.insert(RT->getKeyUnsafe());
+            engine.keepObject(RT->getKeyUnsafe());
+        }
+        return RT;
+    }
+
+   public:
+    jvavJIT(jitEngine& jit, const string& name)
+        : engine(jit),
+          mainJD(jit.getSession().createBareJITDylib(name)),
+          mangle(jit.getSession(), jit.getDataLayout()) {
+        SymbolMap builtins;
+        for (auto& B : runtimeBuiltins)
+            builtins[mangle(B.name)] = JITEvaluatedSymbol(
+                pointerToJITTargetAddress(B.address), JITSymbolFlags::Exported);
+        cantFail(mainJD.define(absoluteSymbols(move(builtins))));
+        mainJD.addGenerator(
+            cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                jit.getDataLayout().getGlobalPrefix())));
+    }
+    ~jvavJIT() {
+        for (ResourceKey K : kept) engine.dropObject(K);
+        if (auto err = engine.getSession().removeJITDylib(mainJD))
+            engine.getSession().reportError(move(err));
+    }
+
+    const DataLayout& getDataLayout() const { return engine.getDataLayout(); }
+    TargetMachine& getTargetMachine() { return engine.getTargetMachine(); }
+    unsigned getVecWidth() const { return engine.getVecWidth(); }
+    bool hasVectorMath() const { return engine.hasVectorMath(); }
+
+    ResourceTrackerSP addModule(ThreadSafeModule TSM) {
+        auto RT = mainJD.createResourceTracker();
+        cantFail(engine.getCompileLayer().add(RT, move(TSM)));
+        return RT;
+    }
+    // addObject - link compiled object code, NULL if it is not an object
+    ResourceTrackerSP addObject(unique_ptr<MemoryBuffer> obj) {
+        auto RT = mainJD.createResourceTracker();
+        if (auto err = engine.getObjectLayer().add(RT, move(obj))) {
+            consumeError(move(err));
+            return NULL;
+        }
+        return RT;
+    }
+    // addDefinition - JIT the module of a def, or its object code from a
+    // snapshot; with keep, the object code is kept once it is linked
+    ResourceTrackerSP addDefinition(ThreadSafeModule TSM, const string& name,
+                                    memoTable* table, bool keep) {
+        auto RT = trackDefinition(name, table, keep);
+        cantFail(engine.getCompileLayer().add(RT, move(TSM)));
+        return RT;
+    }
+    ResourceTrackerSP addDefinition(unique_ptr<MemoryBuffer> obj,
+                                    const string& name, memoTable* table,
+                                    bool keep) {
+        auto RT = trackDefinition(name, table, keep);
+        if (auto err = engine.getObjectLayer().add(RT, move(obj))) {
+            consumeError(move(err));
+            removeModule(RT);
+            return NULL;
+        }
+        return RT;
+    }
+    // keptObject - the object code of a def added with keep, once linked
+    bool keptObject(ResourceTrackerSP RT, string& bytes) {
+        return engine.keptObject(RT->getKeyUnsafe(), bytes);
+    }
+    Expected<JITEvaluatedSymbol> findSymbol(StringRef name) {
+        return engine.getSession().lookup({&mainJD}, mangle(name));
+    }
+    void removeModule(ResourceTrackerSP RT) {
+        if (kept.erase(RT->getKeyUnsafe()))
+            engine.dropObject(RT->getKeyUnsafe());
+        cantFail(RT->remove());
+    }
+};
+
+// functionOptimizer - the function passes of a session, set up once by
+// ensureBackend. Every def and expression is a module of its own; what the
+// analyses learned about a function is dropped once it is optimized, as the
+// function is not looked at again and its address will be reused.
+class functionOptimizer {
+   public:
+    // passChange - a pass that changed the size of the function, when the
+    // optimizer is set up to watch (--opt-report)
+    struct passChange {
+        string pass;
+        unsigned before, after;  // IR instructions
+    };
+
+   private:
+    PassInstrumentationCallbacks PIC;
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    FunctionPassManager FPM;
+    vector<unsigned> sizes;  // before each pass still running
+    vector<passChange> changes;
+
+    static const Function* functionOf(Any IR) {
+        if (any_isa<const Function*>(IR)) return any_cast<const Function*>(IR);
+        if (any_isa<const Loop*>(IR))
+            return any_cast<const Loop*>(IR)->getHeader()->getParent();
+        return NULL;
+    }
+    void watchPasses() {
+        PIC.registerBeforeNonSkippedPassCallback([this](StringRef, Any IR) {
+            const Function* F = functionOf(IR);
+            sizes.push_back(F ? F->getInstructionCount() : 0);
+        });
+        PIC.registerAfterPassCallback(
+            [this](StringRef pass, Any IR, const PreservedAnalyses&) {
+                unsigned before = sizes.back();
+                sizes.pop_back();
+                const Function* F = functionOf(IR);
+                // the pass managers and adaptors only sum up their passes
+                if (!F || pass.contains("PassManager") ||
+                    pass.contains("PassAdaptor"))
+                    return;
+                unsigned after = F->getInstructionCount();
+                if (after != before)
+                    changes.push_back({pass.str(), before, after});
+            });
+        PIC.registerAfterPassInvalidatedCallback(
+            [this](StringRef, const PreservedAnalyses&) { sizes.pop_back(); });
+    }
+
+   public:
+    functionOptimizer(TargetMachine& TM, bool vectorMath, bool watch) {
+        if (watch) watchPasses();
+        // the vectorizers' cost model needs the host target
+        PassBuilder PB(&TM, PipelineTuningOptions(), None,
+                       watch ? &PIC : NULL);
+        // what the C library offers, so calls to it can be folded and
+        // vectorized
+        TargetLibraryInfoImpl TLII(TM.getTargetTriple());
+        if (vectorMath)
+            TLII.addVectorizableFunctionsFromVecLib(
+                TargetLibraryInfoImpl::LIBMVEC_X86);
+        FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+        FPM.addPass(PromotePass());
+        FPM.addPass(InstCombinePass());
+        FPM.addPass(ReassociatePass());
+        FPM.addPass(GVNPass());
+        FPM.addPass(TailCallElimPass());
+        FPM.addPass(SimplifyCFGPass());
+
+        // loop optimizations
+        LoopPassManager LPM;
+        LPM.addPass(LoopRotatePass());
+        LPM.addPass(LICMPass());
+        LPM.addPass(IndVarSimplifyPass());
+        FPM.addPass(createFunctionToLoopPassAdaptor(move(LPM), true));
+        FPM.addPass(InjectTLIMappings());
+        FPM.addPass(LoopVectorizePass());
+        FPM.addPass(LoopUnrollPass());
+        FPM.addPass(SLPVectorizerPass());
+        FPM.addPass(InstCombinePass());
+        FPM.addPass(SimplifyCFGPass());
+    }
+
+    void run(Function& F) {
+        FPM.run(F, FAM);
+        LAM.clear();
+        FAM.clear();
+    }
+    // takeChanges - what the passes did to the functions run since last time
+    vector<passChange> takeChanges() { return move(changes); }
+};
+
+/**
+ * * 代码生成: AST to LLVM IR (codegen())
+ * * Author: Amiriox
+ * TODO : NULL
+ */
+static unique_ptr<jitEngine> theEngine;
+static bool fastMath = false;  // --fast-math, allow reassociation etc.
+// profileListener - --profile: told about all code the engine loads, and the
+// generated code keeps its frame pointers; see samplingProfiler
+static JITEventListener* profileListener = NULL;
+static void reportProfile(FILE* out);
+static thread_local unique_ptr<LLVMContext> theContext;
+static thread_local unique_ptr<IRBuilder<>> builder;
+static thread_local unique_ptr<Module> theModule;
+static thread_local map<string, AllocaInst*> namedValues;
+// loopInductions - i64 copies of the counted loop variables in scope, keyed by
+// their stack slot, so array indices need no double round trip
+static thread_local map<AllocaInst*, Value*> loopInductions;
+static thread_local unique_ptr<functionOptimizer> theFPM;
+// optReport - --opt-report: what the optimizer and the code generator did to
+// each def and expression, see writeOptReport
+static unique_ptr<raw_fd_ostream> optReport;
+static void watchRemarks(LLVMContext& context);
+static void optimizeReported(Function& F);
+static void writeOptReport();
+static thread_local unique_ptr<jvavJIT> theJIT;
+static thread_local map<string, unique_ptr<prototypeAST>> functionProtos;
+// definedFunctions - names with a def in this session, which take precedence
+// over the math builtins
+static thread_local set<string> definedFunctions;
+// pureFunctions - defs whose result depends on nothing but their arguments,
+// the ones a memo def may call
+static thread_local set<string> pureFunctions;
+// memoTables - the result tables of this session's memo defs; generated code
+// holds their addresses, so they live until the session's code is released
+static thread_local vector<unique_ptr<memoTable>> memoTables;
+// liveDefinition - what a session keeps of a compiled def, so forget can
+// release it again
+struct liveDefinition {
+    ResourceTrackerSP tracker;  // its object in the JIT
+    uint64_t object = 0;        // or in the executors, with remoteExecution
+    set<string> callees;        // the other defs its code calls
+    memoTable* table = NULL;    // a memo def's results
+};
+static thread_local map<string, liveDefinition> liveDefinitions;
+// remoteExecution - --executors: the session only compiles, and the code
+// runs in executor processes, see executorPool
+static bool remoteExecution = false;
+static thread_local uint64_t sessionId;  // the session, to the executors
+// keepObjects - whether the session keeps the object code of its defs, so
+// that it can be saved with :save; only with --savable, and not in served
+// sessions
+static bool savable = false;  // --savable
+static thread_local bool keepObjects;
+
+Value* valueLogError(const char* str) {
+    logError(str);
+    return NULL;
+}
+Function* getFunction(string Name) {
+    // First, see if the function has already been added to the current module
+    if (auto* F = theModule->getFunction(Name)) return F;
+
+    auto FI = functionProtos.find(Name);
+    if (FI != functionProtos.end()) return FI->second->codegen();
+
+    return NULL;
+}
+
+// llvmType - how a value of the given type is passed around in IR
+static Type* llvmType(valueType type) {
+    Type* doubleTy = Type::getDoubleTy(*theContext);
+    switch (type) {
+        case tyDoubleArray:
+            return PointerType::getUnqual(doubleTy);
+        case tyVec:
+            return FixedVectorType::get(doubleTy, theJIT->getVecWidth());
+        case tyI64:
+            return Type::getInt64Ty(*theContext);
+        case tyBool:
+            return Type::getInt1Ty(*theContext);
+        default:
+            return doubleTy;
+    }
+}
+
+// isNumber - whether a generated value is a double
+static bool isNumber(Value* V) { return V->getType()->isDoubleTy(); }
+
+// isArithmetic - whether a generated value is a bool, an i64, a double or a vec
+static bool isArithmetic(Value* V) {
+    Type* T = V->getType();
+    return T->isIntegerTy() || T->isDoubleTy() || T->isVectorTy();
+}
+
+// isIntegralConstant - a double literal (or folded constant) that is a whole
+// number an i64 can hold
+static bool isIntegralConstant(Value* V) {
+    auto* C = dyn_cast<ConstantFP>(V);
+    if (!C) return false;
+    double D = C->getValueAPF().convertToDouble();
+    return D == floor(D) && fabs(D) < 9223372036854775808.0;
+}
+
+// coerceTo - V as a value of type where the conversion is implicit: a bool
+// widens to 0 or 1, an i64 to a double, a number is broadcast to a vec and an
+// integral double constant becomes an i64; NULL otherwise, unreported. The
+// i64 to double widening is exact only up to 2^53 in magnitude, beyond that
+// it rounds to the nearest double, like a C conversion.
+static Value* coerceTo(Value* V, Type* type) {
+    Type* from = V->getType();
+    if (from == type) return V;
+    if (type->isVectorTy()) {
+        auto* vecTy = cast<FixedVectorType>(type);
+        V = coerceTo(V, vecTy->getElementType());
+        if (!V) return NULL;
+        return builder->CreateVectorSplat(vecTy->getNumElements(), V, "splat");
+    }
+    if (type->isDoubleTy()) {
+        if (from->isIntegerTy(1)) return builder->CreateUIToFP(V, type, "booltmp");
+        if (from->isIntegerTy()) return builder->CreateSIToFP(V, type, "itofp");
+        return NULL;
+    }
+    if (type->isIntegerTy(64)) {
+        if (from->isIntegerTy(1)) return builder->CreateZExt(V, type, "booltmp");
+        if (isIntegralConstant(V))
+            return ConstantInt::get(
+                type,
+                (int64_t)cast<ConstantFP>(V)->getValueAPF().convertToDouble(),
+                true);
+    }
+    return NULL;
+}
+
+// arithmeticType - the type both operands of an arithmetic operator (or both
+// arms of an if) are brought to: a vec if either is one, an i64 if one is an
+// i64 and the other an i64, a bool or an integral constant, else a double
+static Type* arithmeticType(Value* L, Value* R) {
+    Type* LT = L->getType();
+    Type* RT = R->getType();
+    if (LT->isVectorTy()) return LT;
+    if (RT->isVectorTy()) return RT;
+    if (LT->isIntegerTy(64) && (RT->isIntegerTy() || isIntegralConstant(R)))
+        return LT;
+    if (RT->isIntegerTy(64) && (LT->isIntegerTy() || isIntegralConstant(L)))
+        return RT;
+    return Type::getDoubleTy(*theContext);
+}
+
+// codegenCondition - the i1 a branch tests: a bool itself, an i64 or a
+// double compared against zero; NULL for anything else, unreported
+static Value* codegenCondition(Value* V, const char* name) {
+    Type* T = V->getType();
+    if (T->isIntegerTy(1)) return V;
+    if (T->isIntegerTy())
+        return builder->CreateICmpNE(V, ConstantInt::get(T, 0), name);
+    if (T->isDoubleTy())
+        return builder->CreateFCmpONE(V, ConstantFP::get(T, 0.0), name);
+    return NULL;
+}
+
+// createEntryBlockAlloca - stack slot for a mutable variable in the entry
+// block of the function, where mem2reg can promote it to a register
+static AllocaInst* createEntryBlockAlloca(Function* theFunction,
+                                          const string& varName, Type* type) {
+    IRBuilder<> tmpB(&theFunction->getEntryBlock(),
+                     theFunction->getEntryBlock().begin());
+    return tmpB.CreateAlloca(type, NULL, varName);
+}
+
+Value* numExprAST::codegen() {
+    return ConstantFP::get(*theContext, APFloat(Val));
+}
+
+Value* variableExprAST::codegen() {
+    auto V = namedValues.find(name);
+    if (V == namedValues.end())
+        return valueLogError("use of undeclared identifier");
+    return builder->CreateLoad(V->second->getAllocatedType(), V->second,
+                               name.c_str());
+}
+
+// integerIndex - an index built only from i64 and counted loop variables,
+// integral literals, '+', '-' and '*' computed directly in i64, or NULL
+static Value* integerIndex(exprAST& E) {
+    Type* i64 = Type::getInt64Ty(*theContext);
+    switch (E.getKind()) {
+        case astNumber: {
+            double V = static_cast<numExprAST&>(E).getValue();
+            if (V != floor(V) || fabs(V) >= 9007199254740992.0) return NULL;
+            return ConstantInt::get(i64, (int64_t)V, true);
+        }
+        case astVariable: {
+            auto& name = static_cast<variableExprAST&>(E).getName();
+            auto V = namedValues.find(name);
+            if (V == namedValues.end()) return NULL;
+            if (V->second->getAllocatedType() == i64)
+                return builder->CreateLoad(i64, V->second, name.c_str());
+            auto I = loopInductions.find(V->second);
+            return I == loopInductions.end() ? NULL : I->second;
+        }
+        case astBinary: {
+            auto& B = static_cast<binaryExprAST&>(E);
+            if (B.getOp() != '+' && B.getOp() != '-' && B.getOp() != '*')
+                return NULL;
+            Value* L = integerIndex(B.getLHS());
+            if (!L) return NULL;
+            Value* R = integerIndex(B.getRHS());
+            if (!R) return NULL;
+            if (B.getOp() == '+') return builder->CreateAdd(L, R, "idx");
+            if (B.getOp() == '-') return builder->CreateSub(L, R, "idx");
+            return builder->CreateMul(L, R, "idx");
+        }
+        default:
+            return NULL;
+    }
+}
+
+// codegenIndex - an array index or vec lane as i64
+static Value* codegenIndex(exprAST& index) {
+    if (Value* V = integerIndex(index)) return V;
+    Value* V = index.codegen();
+    if (!V) return NULL;
+    Type* i64 = Type::getInt64Ty(*theContext);
+    if (Value* I = coerceTo(V, i64)) return I;
+    if (!isNumber(V)) return valueLogError("index must be a number");
+    return builder->CreateFPToSI(V, i64, "idx");
+}
+
+// codegenLane - the lane of a vec an index selects. A constant index must be
+// a lane of the vec; for a computed one inRange is set to whether it is, as a
+// lane past the end is not wrapped around
+static Value* codegenLane(exprAST& index, Type* vecTy, Value*& inRange) {
+    Value* indexV = codegenIndex(index);
+    if (!indexV) return NULL;
+    unsigned width = cast<FixedVectorType>(vecTy)->getNumElements();
+    inRange = NULL;
+    if (auto* C = dyn_cast<ConstantInt>(indexV)) {
+        if (C->getValue().uge(width))
+            return valueLogError("vec lane out of range");
+        return indexV;
+    }
+    inRange = builder->CreateICmpULT(indexV, builder->getInt64(width),
+                                     "laneinrange");
+    return indexV;
+}
+
+// findSubscripted - the stack slot of an array or vec variable
+static AllocaInst* findSubscripted(const string& name) {
+    auto variable = namedValues.find(name);
+    if (variable == namedValues.end()) {
+        logError("use of undeclared identifier");
+        return NULL;
+    }
+    Type* type = variable->second->getAllocatedType();
+    if (!type->isPointerTy() && !type->isVectorTy()) {
+        logError("subscripted value is not an array or vec");
+        return NULL;
+    }
+    return variable->second;
+}
+
+Value* indexExprAST::codegenAddress(AllocaInst* array) {
+    Value* indexV = codegenIndex(*index);
+    if (!indexV) return NULL;
+    Value* base =
+        builder->CreateLoad(array->getAllocatedType(), array, name.c_str());
+    return builder->CreateInBoundsGEP(Type::getDoubleTy(*theContext), base,
+                                      indexV, "eltaddr");
+}
+
+Value* indexExprAST::codegen() {
+    AllocaInst* variable = findSubscripted(name);
+    if (!variable) return NULL;
+    Type* type = variable->getAllocatedType();
+    if (type->isVectorTy()) {
+        // a lane that is not there reads as NaN
+        Value* inRange;
+        Value* lane = codegenLane(*index, type, inRange);
+        if (!lane) return NULL;
+        Value* vecV = builder->CreateLoad(type, variable, name.c_str());
+        Value* laneV = builder->CreateExtractElement(vecV, lane, "lanetmp");
+        if (!inRange) return laneV;
+        return builder->CreateSelect(
+            inRange, laneV,
+            ConstantFP::getNaN(Type::getDoubleTy(*theContext)), "lanetmp");
+    }
+    Value* address = codegenAddress(variable);
+    if (!address) return NULL;
+    return builder->CreateLoad(Type::getDoubleTy(*theContext), address, "elt");
+}
+
+Value* indexExprAST::codegenAssign(exprAST& rhs) {
+    AllocaInst* variable = findSubscripted(name);
+    if (!variable) return NULL;
+    Type* type = variable->getAllocatedType();
+    Value* inRange = NULL;
+    Value* destination = type->isVectorTy()
+                             ? codegenLane(*index, type, inRange)
+                             : codegenAddress(variable);
+    if (!destination) return NULL;
+
+    Value* val = rhs.codegen();
+    if (!val) return NULL;
+    val = coerceTo(val, Type::getDoubleTy(*theContext));
+    if (!val) return valueLogError("type mismatch in assignment");
+    if (type->isVectorTy()) {
+        // a store to a lane that is not there leaves the vec as it is
+        Value* vecV = builder->CreateLoad(type, variable, name.c_str());
+        Value* stored = builder->CreateInsertElement(vecV, val, destination);
+        if (inRange) stored = builder->CreateSelect(inRange, stored, vecV);
+        builder->CreateStore(stored, variable);
+    } else {
+        builder->CreateStore(val, destination);
+    }
+    return val;
+}
+
+// codegen - the operands of nested operators are generated with an explicit
+// stack of the operators waiting for them; assignments and every other kind
+// of operand are generated as usual
+Value* binaryExprAST::codegen() {
+    if (op == '=') return codegenAssign();
+
+    struct frame {
+        binaryExprAST* node;
+        Value* L;       // the left operand, once generated
+        int generated;  // operands generated so far
+    };
+    vector<frame> pending{{this, NULL, 0}};
+    Value* V = NULL;  // the operand generated last
+    while (true) {
+        frame& F = pending.back();
+        if (F.generated == 2) {
+            V = F.L && V ? F.node->codegenOperator(F.L, V) : NULL;
+            pending.pop_back();
+            if (pending.empty()) return V;
+            if (++pending.back().generated == 1) pending.back().L = V;
+            continue;
+        }
+        exprAST& operand = F.generated ? *F.node->RHS : *F.node->LHS;
+        if (operand.getKind() == astBinary &&
+            static_cast<binaryExprAST&>(operand).op != '=') {
+            pending.push_back({static_cast<binaryExprAST*>(&operand), NULL, 0});
+            continue;
+        }
+        V = operand.codegen();
+        if (++F.generated == 1) F.L = V;
+    }
+}
+
+// codegenAssign - assignment does not evaluate its left hand side
+Value* binaryExprAST::codegenAssign() {
+    if (LHS->getKind() == astIndex)
+        return static_cast<indexExprAST&>(*LHS).codegenAssign(*RHS);
+    if (LHS->getKind() != astVariable)
+        return valueLogError("destination of '=' must be a variable or element");
+    auto& name = static_cast<variableExprAST&>(*LHS).getName();
+    auto variable = namedValues.find(name);
+    if (variable == namedValues.end())
+        return valueLogError("unknown variable name");
+
+    Value* val = RHS->codegen();
+    if (!val) return NULL;
+    val = coerceTo(val, variable->second->getAllocatedType());
+    if (!val) return valueLogError("type mismatch in assignment");
+    builder->CreateStore(val, variable->second);
+    return val;
+}
+
+// codegenOperator - apply the operator to its generated operands
+Value* binaryExprAST::codegenOperator(Value* L, Value* R) {
+    if (op == ':') return R;  // sequence, the value of the right hand side
+
+    if (!isArithmetic(L) || !isArithmetic(R))
+        return valueLogError(
+            "operands of a binary operator must be numbers or vecs");
+    Type* operandTy = arithmeticType(L, R);
+    L = coerceTo(L, operandTy);
+    R = coerceTo(R, operandTy);
+
+    if (operandTy->isIntegerTy()) {
+        switch (op) {
+            case '+':
+                return builder->CreateAdd(L, R, "addtmp");
+            case '-':
+                return builder->CreateSub(L, R, "subtmp");
+            case '*':
+                return builder->CreateMul(L, R, "multmp");
+            case '<':
+                return builder->CreateICmpSLT(L, R, "cmptmp");
+            default:
+                return valueLogError("invalid binary operator");
+        }
+    }
     switch (op) {
         case '+':
-            return builder.CreateFAdd(L, R, "addtmp");
+            return builder->CreateFAdd(L, R, "addtmp");
         case '-':
-            return builder.CreateFSub(L, R, "subtmp");
+            return builder->CreateFSub(L, R, "subtmp");
         case '*':
-            return builder.CreateFMul(L, R, "multmp");
+            return builder->CreateFMul(L, R, "multmp");
         case '<':
-            L = builder.CreateFCmpULT(L, R, "cmptmp");
-            return builder.CreateUIToFP(L, Type::getDoubleTy(theContext),
-                                        "booltmp");
+            if (!operandTy->isVectorTy())
+                return builder->CreateFCmpULT(L, R, "cmptmp");
+            // 1.0 or 0.0, lane by lane
+            return builder->CreateUIToFP(builder->CreateFCmpULT(L, R, "cmptmp"),
+                                        operandTy, "booltmp");
         default:
             return valueLogError("invalid binary operator");
     }
 }
-Value* callExprAST::codegen() {
-    //! remark {
-    // * 在LLVM模块的符号表中
-    //* 执行函数名查找 如sin和cos
-    //! }
-    Function* CalleeF = theModule->getFunction(callee);
-    if (!CalleeF) {
-        return valueLogError("unknown function referenced");
+// mathBuiltins - the C library math functions callExprAST lowers to
+// intrinsics
+static const struct {
+    const char* name;
+    Intrinsic::ID id;
+    unsigned arity;
+} mathBuiltins[] = {
+    {"sqrt", Intrinsic::sqrt, 1},   {"sin", Intrinsic::sin, 1},
+    {"cos", Intrinsic::cos, 1},     {"exp", Intrinsic::exp, 1},
+    {"exp2", Intrinsic::exp2, 1},   {"log", Intrinsic::log, 1},
+    {"log2", Intrinsic::log2, 1},   {"log10", Intrinsic::log10, 1},
+    {"fabs", Intrinsic::fabs, 1},   {"floor", Intrinsic::floor, 1},
+    {"ceil", Intrinsic::ceil, 1},   {"trunc", Intrinsic::trunc, 1},
+    {"round", Intrinsic::round, 1}, {"pow", Intrinsic::pow, 2},
+    {"fmin", Intrinsic::minnum, 2}, {"fmax", Intrinsic::maxnum, 2},
+    {"copysign", Intrinsic::copysign, 2},
+    {"fma", Intrinsic::fma, 3}};
+
+Value* callExprAST::codegen() {
+    //! remark {
+    // * 在LLVM模块的符号表中
+    //* 执行函数名查找 如sin和cos
+    //! }
+    // math builtins become LLVM intrinsics, so they fold, vectorize and use
+    // the host's instructions; this includes names declared extern
+    if (!definedFunctions.count(callee))
+        for (auto& math : mathBuiltins)
+            if (callee == math.name && args.size() == math.arity)
+                return codegenMathBuiltin(math.id);
+
+    Function* CalleeF = getFunction(callee);
+    if (!CalleeF) {
+        // the vec and parallel builtins, unless the session defines the name
+        // itself
+        if (callee == "parfor" || callee == "parsum")
+            return codegenParallelBuiltin();
+        return codegenVectorBuiltin();
+    }
+
+    if (CalleeF->arg_size() != args.size()) {
+        return valueLogError("Incorrect # arguments passed");
+    }
+
+    vector<Value*> argsV;
+    for (unsigned i = 0, e = args.size(); i != e; ++i) {
+        Value* argV = args[i]->codegen();
+        if (!argV) return NULL;
+        argV = coerceTo(argV, CalleeF->getArg(i)->getType());
+        if (!argV) return valueLogError("argument type mismatch in call");
+        argsV.push_back(argV);
+    }
+
+    CallInst* call = builder->CreateCall(CalleeF, argsV, "calltmp");
+    call->setTailCall(isTail);
+    // a def named like a C library function is not that function
+    if (definedFunctions.count(callee)) call->addFnAttr(Attribute::NoBuiltin);
+    return call;
+}
+
+// codegenMathBuiltin - the intrinsic on doubles, or on vecs lane by lane if
+// any argument is a vec
+Value* callExprAST::codegenMathBuiltin(Intrinsic::ID id) {
+    vector<Value*> argsV;
+    bool lanes = false;
+    for (auto& arg : args) {
+        Value* argV = arg->codegen();
+        if (!argV) return NULL;
+        if (!isArithmetic(argV))
+            return valueLogError("argument type mismatch in call");
+        lanes |= argV->getType()->isVectorTy();
+        argsV.push_back(argV);
+    }
+    Type* type = lanes ? llvmType(tyVec) : Type::getDoubleTy(*theContext);
+    for (auto& argV : argsV) argV = coerceTo(argV, type);
+    return builder->CreateIntrinsic(id, {type}, argsV, NULL, callee);
+}
+
+// codegenParallelBuiltin - parfor(f, a, b) calls f(i) for every integer i in
+// [a, b) on the work pool and is 0, parsum(f, a, b) is the sum of those f(i).
+// f is a def of one double or i64; it is called through an adapter taking
+// the index as an i64 and returning a double, the signature of parallelSum.
+Value* callExprAST::codegenParallelBuiltin() {
+    if (args.size() != 3) return valueLogError("Incorrect # arguments passed");
+    Function* body = NULL;
+    if (args[0]->getKind() == astVariable)
+        body = getFunction(static_cast<variableExprAST&>(*args[0]).getName());
+    Type* doubleTy = Type::getDoubleTy(*theContext);
+    Type* i64 = Type::getInt64Ty(*theContext);
+    Type* indexTy = body && body->arg_size() == 1 ? body->getArg(0)->getType()
+                                                  : NULL;
+    Type* resultTy = body ? body->getReturnType() : NULL;
+    if (!indexTy || (indexTy != doubleTy && indexTy != i64) ||
+        (!resultTy->isDoubleTy() && !resultTy->isIntegerTy()))
+        return valueLogError(
+            "parfor and parsum take a def of one number and a range");
+
+    Value* beginV = codegenIndex(*args[1]);
+    if (!beginV) return NULL;
+    Value* endV = codegenIndex(*args[2]);
+    if (!endV) return NULL;
+
+    FunctionType* adapterTy = FunctionType::get(doubleTy, {i64}, false);
+    Function* adapter =
+        Function::Create(adapterTy, Function::InternalLinkage,
+                         "par." + body->getName(), theModule.get());
+    if (profileListener) adapter->addFnAttr("frame-pointer", "all");
+    auto insertPoint = builder->saveIP();
+    builder->SetInsertPoint(BasicBlock::Create(*theContext, "entry", adapter));
+    Value* index = adapter->getArg(0);
+    if (indexTy == doubleTy)
+        index = builder->CreateSIToFP(index, doubleTy, "index");
+    CallInst* call = builder->CreateCall(body, {index}, "calltmp");
+    if (definedFunctions.count(body->getName().str()))
+        call->addFnAttr(Attribute::NoBuiltin);
+    builder->CreateRet(coerceTo(call, doubleTy));
+    builder->restoreIP(insertPoint);
+    verifyFunction(*adapter);
+
+    FunctionCallee run = theModule->getOrInsertFunction(
+        "__jvav_parallel_sum", doubleTy, PointerType::getUnqual(adapterTy), i64,
+        i64);
+    Value* sum = builder->CreateCall(run, {adapter, beginV, endV}, callee);
+    return callee == "parsum" ? sum : ConstantFP::get(doubleTy, 0.0);
+}
+
+// codegenVectorBuiltin - vec(x) broadcasts x, vload(a, i) and vstore(a, i, v)
+// move vwidth() elements between a[i..] and a vec, vsum(v), vmin(v) and
+// vmax(v) reduce a vec to a number
+Value* callExprAST::codegenVectorBuiltin() {
+    static const struct {
+        const char* name;
+        unsigned arity;
+    } builtins[] = {{"vec", 1},  {"vload", 2}, {"vstore", 3}, {"vsum", 1},
+                    {"vmin", 1}, {"vmax", 1},  {"vwidth", 0}};
+    auto builtin = find_if(begin(builtins), end(builtins), [&](auto& B) {
+        return callee == B.name;
+    });
+    if (builtin == end(builtins))
+        return valueLogError("unknown function referenced");
+    if (args.size() != builtin->arity)
+        return valueLogError("Incorrect # arguments passed");
+
+    bool memory = callee == "vload" || callee == "vstore";
+    vector<Value*> argsV;
+    for (unsigned i = 0; i < args.size(); ++i) {
+        // the element index of vload and vstore
+        argsV.push_back(memory && i == 1 ? codegenIndex(*args[i])
+                                         : args[i]->codegen());
+        if (!argsV.back()) return NULL;
+    }
+
+    Type* doubleTy = Type::getDoubleTy(*theContext);
+    Type* vecTy = llvmType(tyVec);
+    if (callee == "vwidth") return ConstantFP::get(doubleTy, theJIT->getVecWidth());
+    if (callee == "vec") {
+        Value* splat = coerceTo(argsV[0], vecTy);
+        if (!splat || argsV[0]->getType()->isVectorTy())
+            return valueLogError("argument type mismatch in call");
+        return splat;
+    }
+    if (memory) {
+        if (argsV[0]->getType() != llvmType(tyDoubleArray) ||
+            (callee == "vstore" && argsV[2]->getType() != vecTy))
+            return valueLogError("argument type mismatch in call");
+        Value* address = builder->CreateBitCast(
+            builder->CreateInBoundsGEP(doubleTy, argsV[0], argsV[1]),
+            PointerType::getUnqual(vecTy), "vecaddr");
+        if (callee == "vload")
+            return builder->CreateAlignedLoad(vecTy, address, Align(8),
+                                              "vload");
+        builder->CreateAlignedStore(argsV[2], address, Align(8));
+        return ConstantFP::get(doubleTy, 0.0);
+    }
+
+    // reductions
+    if (argsV[0]->getType() != vecTy)
+        return valueLogError("argument type mismatch in call");
+    if (callee == "vmin") return builder->CreateFPMinReduce(argsV[0]);
+    if (callee == "vmax") return builder->CreateFPMaxReduce(argsV[0]);
+    // a horizontal sum, lane after lane as the scalar loop would add it;
+    // --fast-math lets it be added pairwise instead
+    return builder->CreateFAddReduce(ConstantFP::get(doubleTy, -0.0),
+                                     argsV[0]);
+}
+
+Value* ifExprAST::codegen() {
+    Value* condV = cond->codegen();
+    if (!condV) return NULL;
+    // a comparison is branched on directly, a number is compared with zero
+    condV = codegenCondition(condV, "ifcond");
+    if (!condV) return valueLogError("condition must be a number");
+
+    Function* theFunction = builder->GetInsertBlock()->getParent();
+
+    // the then block is inserted at the end of the function, the others are
+    // added once the blocks before them are complete
+    BasicBlock* thenBB = BasicBlock::Create(*theContext, "then", theFunction);
+    BasicBlock* elseBB = BasicBlock::Create(*theContext, "else");
+    BasicBlock* mergeBB = BasicBlock::Create(*theContext, "ifcont");
+    builder->CreateCondBr(condV, thenBB, elseBB);
+
+    builder->SetInsertPoint(thenBB);
+    Value* thenV = then->codegen();
+    if (!thenV) return NULL;
+    builder->CreateBr(mergeBB);
+    // codegen of 'then' can change the current block, update thenBB for phi
+    thenBB = builder->GetInsertBlock();
+
+    theFunction->getBasicBlockList().push_back(elseBB);
+    builder->SetInsertPoint(elseBB);
+    Value* elseV = otherwise->codegen();
+    if (!elseV) return NULL;
+    builder->CreateBr(mergeBB);
+    elseBB = builder->GetInsertBlock();
+
+    // arms of different types meet at their arithmetic type, each converted
+    // at the end of its own block
+    Type* resultTy = thenV->getType();
+    if (elseV->getType() != resultTy) {
+        if (!isArithmetic(thenV) || !isArithmetic(elseV))
+            return valueLogError("then and else have different types");
+        resultTy = arithmeticType(thenV, elseV);
+        builder->SetInsertPoint(thenBB->getTerminator());
+        thenV = coerceTo(thenV, resultTy);
+        builder->SetInsertPoint(elseBB->getTerminator());
+        elseV = coerceTo(elseV, resultTy);
+    }
+
+    theFunction->getBasicBlockList().push_back(mergeBB);
+    builder->SetInsertPoint(mergeBB);
+    PHINode* phi = builder->CreatePHI(resultTy, 2, "iftmp");
+    phi->addIncoming(thenV, thenBB);
+    phi->addIncoming(elseV, elseBB);
+    return phi;
+}
+
+// isCountedLoop - whether the loop is 'for v = a, v < e, s in body' with
+// integer literals a and s > 0 and an end e that the body cannot change
+// (only literals and variables the body never assigns). Such a loop runs
+// exactly ceil((e - a) / s) times, so it is emitted with an integer trip
+// counter that the vectorizers and the unroller can reason about. An i64 loop
+// variable needs no such help.
+bool forExprAST::isCountedLoop() const {
+    if (varType != tyDouble) return false;
+    auto isIntegral = [](const exprAST* E, bool positive) {
+        if (!E || E->getKind() != astNumber) return false;
+        double V = static_cast<const numExprAST*>(E)->getValue();
+        return V == floor(V) && fabs(V) < 9007199254740992.0 &&
+               (!positive || V > 0);
+    };
+    if (!isIntegral(start.get(), false)) return false;
+    if (step && !isIntegral(step.get(), true)) return false;
+
+    if (end->getKind() != astBinary) return false;
+    auto& cmp = static_cast<const binaryExprAST&>(*end);
+    if (cmp.getOp() != '<' || cmp.getLHS().getKind() != astVariable ||
+        static_cast<variableExprAST&>(cmp.getLHS()).getName() != varName)
+        return false;
+
+    // variables assigned anywhere in the body, including the loop variable
+    set<string> assigned;
+    forEachNode(*body, [&](exprAST& E) {
+        if (E.getKind() == astBinary) {
+            auto& B = static_cast<binaryExprAST&>(E);
+            if (B.getOp() == '=' && B.getLHS().getKind() == astVariable)
+                assigned.insert(
+                    static_cast<variableExprAST&>(B.getLHS()).getName());
+        }
+        return true;
+    });
+    if (assigned.count(varName)) return false;
+
+    // the bound must be invariant: literals, variables and arithmetic only
+    bool invariant = true;
+    forEachNode(cmp.getRHS(), [&](exprAST& E) {
+        switch (E.getKind()) {
+            case astNumber:
+                break;
+            case astVariable:
+                if (assigned.count(static_cast<variableExprAST&>(E).getName()))
+                    invariant = false;
+                break;
+            case astBinary:
+                if (static_cast<binaryExprAST&>(E).getOp() == '=')
+                    invariant = false;
+                break;
+            default:
+                invariant = false;
+                break;
+        }
+        return invariant;
+    });
+    return invariant;
+}
+
+// for v = a, cond, s in body  is  v = a; while (cond) { body; v += s }
+Value* forExprAST::codegen() {
+    Function* theFunction = builder->GetInsertBlock()->getParent();
+    Type* doubleTy = Type::getDoubleTy(*theContext);
+    Type* varTy = llvmType(varType);
+
+    // emit the start code first, without the variable in scope
+    Value* startV = start->codegen();
+    if (!startV) return NULL;
+    startV = coerceTo(startV, varTy);
+    if (!startV)
+        return valueLogError("for loop start value has the wrong type");
+    AllocaInst* alloca = createEntryBlockAlloca(theFunction, varName, varTy);
+    builder->CreateStore(startV, alloca);
+
+    // within the loop the variable shadows any outer one of the same name
+    auto shadowed = namedValues.find(varName);
+    AllocaInst* oldVal =
+        shadowed == namedValues.end() ? NULL : shadowed->second;
+    namedValues[varName] = alloca;
+
+    BasicBlock* loopBB = BasicBlock::Create(*theContext, "loop");
+    BasicBlock* afterBB = BasicBlock::Create(*theContext, "afterloop");
+
+    if (isCountedLoop()) {
+        // isCountedLoop made sure a step is a literal
+        double stepValue =
+            step ? static_cast<numExprAST&>(*step).getValue() : 1.0;
+        // trip count = ceil((end - start) / step), clamped to [0, 2^53]
+        Value* endV = static_cast<binaryExprAST&>(*end).getRHS().codegen();
+        if (!endV) return NULL;
+        endV = coerceTo(endV, doubleTy);
+        if (!endV) return valueLogError("for loop bound must be a number");
+        Value* span = builder->CreateFSub(endV, startV, "span");
+        Value* trips = builder->CreateFDiv(
+            span, ConstantFP::get(doubleTy, stepValue), "trips");
+        trips = builder->CreateUnaryIntrinsic(Intrinsic::ceil, trips);
+        trips = builder->CreateMinNum(
+            trips, ConstantFP::get(doubleTy, 9007199254740992.0));
+        Type* i64 = Type::getInt64Ty(*theContext);
+        Value* tripCount = builder->CreateSelect(
+            builder->CreateFCmpOGT(trips, ConstantFP::get(doubleTy, 0.0)),
+            builder->CreateFPToSI(trips, i64), ConstantInt::get(i64, 0),
+            "tripcount");
+        BasicBlock* preheaderBB = builder->GetInsertBlock();
+        builder->CreateCondBr(
+            builder->CreateICmpSGT(tripCount, ConstantInt::get(i64, 0)),
+            loopBB, afterBB);
+
+        // loop: v = start + k * step; body; ++k
+        theFunction->getBasicBlockList().push_back(loopBB);
+        builder->SetInsertPoint(loopBB);
+        PHINode* counter = builder->CreatePHI(i64, 2, "k");
+        counter->addIncoming(ConstantInt::get(i64, 0), preheaderBB);
+        Value* varV = builder->CreateSIToFP(counter, doubleTy);
+        if (stepValue != 1.0)
+            varV = builder->CreateFMul(varV, ConstantFP::get(doubleTy, stepValue));
+        builder->CreateStore(builder->CreateFAdd(startV, varV, varName),
+                             alloca);
+        // the same value in i64 for array indices
+        double startValue = static_cast<numExprAST&>(*start).getValue();
+        loopInductions[alloca] = builder->CreateAdd(
+            ConstantInt::get(i64, (int64_t)startValue, true),
+            builder->CreateMul(counter,
+                               ConstantInt::get(i64, (int64_t)stepValue)),
+            varName + ".i");
+        Value* bodyV = body->codegen();
+        loopInductions.erase(alloca);
+        if (!bodyV) return NULL;
+        Value* next = builder->CreateAdd(counter, ConstantInt::get(i64, 1),
+                                         "nextk", true, true);
+        counter->addIncoming(next, builder->GetInsertBlock());
+        builder->CreateCondBr(builder->CreateICmpSLT(next, tripCount), loopBB,
+                              afterBB);
+    } else {
+        BasicBlock* condBB =
+            BasicBlock::Create(*theContext, "loopcond", theFunction);
+        builder->CreateBr(condBB);
+        builder->SetInsertPoint(condBB);
+        Value* endCond = end->codegen();
+        if (!endCond) return NULL;
+        endCond = codegenCondition(endCond, "loopcond");
+        if (!endCond)
+            return valueLogError("for loop condition must be a number");
+        builder->CreateCondBr(endCond, loopBB, afterBB);
+
+        theFunction->getBasicBlockList().push_back(loopBB);
+        builder->SetInsertPoint(loopBB);
+        if (!body->codegen()) return NULL;
+        Value* stepV = ConstantFP::get(doubleTy, 1.0);
+        if (step) {
+            stepV = step->codegen();
+            if (!stepV) return NULL;
+        }
+        stepV = coerceTo(stepV, varTy);
+        if (!stepV) return valueLogError("for loop step has the wrong type");
+        Value* curVar = builder->CreateLoad(varTy, alloca, varName.c_str());
+        builder->CreateStore(
+            varTy->isIntegerTy()
+                ? builder->CreateAdd(curVar, stepV, "nextvar")
+                : builder->CreateFAdd(curVar, stepV, "nextvar"),
+            alloca);
+        builder->CreateBr(condBB);
+    }
+
+    theFunction->getBasicBlockList().push_back(afterBB);
+    builder->SetInsertPoint(afterBB);
+
+    // restore the unshadowed variable
+    if (oldVal)
+        namedValues[varName] = oldVal;
+    else
+        namedValues.erase(varName);
+
+    // for expr always returns 0.0
+    return Constant::getNullValue(doubleTy);
+}
+
+Value* varExprAST::codegen() {
+    vector<pair<string, AllocaInst*>> oldBindings;
+    Function* theFunction = builder->GetInsertBlock()->getParent();
+
+    // register all variables and emit their initializers; an initializer
+    // cannot see its own variable, so 'var a = a in ...' reads an outer a
+    for (auto& var : varNames) {
+        Type* varTy = llvmType(var.type);
+        Value* initVal = Constant::getNullValue(varTy);
+        if (var.init) {
+            initVal = var.init->codegen();
+            if (!initVal) return NULL;
+        }
+        if (var.declared) {
+            initVal = coerceTo(initVal, varTy);
+            if (!initVal)
+                return valueLogError("initializer does not match the type");
+        }
+
+        AllocaInst* alloca =
+            createEntryBlockAlloca(theFunction, var.name, initVal->getType());
+        builder->CreateStore(initVal, alloca);
+
+        auto shadowed = namedValues.find(var.name);
+        oldBindings.push_back(make_pair(
+            var.name,
+            shadowed == namedValues.end() ? NULL : shadowed->second));
+        namedValues[var.name] = alloca;
+    }
+
+    Value* bodyVal = body->codegen();
+
+    // pop all our variables from scope, innermost first
+    for (auto old = oldBindings.rbegin(); old != oldBindings.rend(); ++old) {
+        if (old->second)
+            namedValues[old->first] = old->second;
+        else
+            namedValues.erase(old->first);
+    }
+    return bodyVal;
+}
+Function* prototypeAST::codegen() {
+    // double(double,double*...)
+    std::vector<Type*> params;
+    for (valueType type : argTypes) params.push_back(llvmType(type));
+    FunctionType* functype = FunctionType::get(llvmType(retType), params, false);
+    Function* func = Function::Create(functype, Function::ExternalLinkage, name,
+                                      theModule.get());
+    if (profileListener) func->addFnAttr("frame-pointer", "all");
+    // set names for all arguments
+    unsigned idx = 0;
+    for (auto& ARG : func->args()) ARG.setName(args[idx++]);
+    return func;
+}
+// isPureCallee - whether a call to callee with argCount arguments has no
+// side effects and reads no host memory; resolved as callExprAST::codegen does
+static bool isPureCallee(const string& callee, size_t argCount) {
+    if (definedFunctions.count(callee)) return pureFunctions.count(callee);
+    for (auto& math : mathBuiltins)
+        if (callee == math.name && argCount == math.arity) return true;
+    if (functionProtos.count(callee)) return false;  // extern
+    return callee == "vec" || callee == "vsum" || callee == "vmin" ||
+           callee == "vmax" || callee == "vwidth";
+}
+
+// findImpurity - why a def's result may depend on more than its arguments,
+// or "" if it cannot. Recursive calls count as pure, as they are if the rest
+// of the def is. With no array in scope, a subscript can only be a vec lane.
+static string findImpurity(const prototypeAST& proto, exprAST& body) {
+    auto& argTypes = proto.getArgTypes();
+    if (count(argTypes.begin(), argTypes.end(), tyDoubleArray) ||
+        proto.getRetType() == tyDoubleArray)
+        return "it passes an array";
+    string reason;
+    forEachNode(body, [&](exprAST& E) {
+        if (E.getKind() == astCall) {
+            auto& call = static_cast<callExprAST&>(E);
+            if (call.getCallee() != proto.getName() &&
+                !isPureCallee(call.getCallee(), call.getArgCount()))
+                reason = "it calls '" + call.getCallee() + "'";
+        } else if (E.getKind() == astVar) {
+            for (auto& var : static_cast<varExprAST&>(E).getVars())
+                if (var.declared && var.type == tyDoubleArray)
+                    reason = "it declares the array '" + var.name + "'";
+        }
+        return reason.empty();
+    });
+    return reason;
+}
+
+bool functionAST::isPure() const {
+    return findImpurity(*prototype, *body).empty();
+}
+
+// checkMemo - a memo def must be pure and take and return only doubles, i64s
+// and bools, or its table could answer with a stale result
+static bool checkMemo(const prototypeAST& proto, exprAST& body) {
+    auto isScalar = [](valueType type) {
+        return type == tyDouble || type == tyI64 || type == tyBool;
+    };
+    auto& argTypes = proto.getArgTypes();
+    if (!all_of(argTypes.begin(), argTypes.end(), isScalar) ||
+        !isScalar(proto.getRetType())) {
+        logError("memo def arguments and result must be double, i64 or bool");
+        return false;
+    }
+    string impurity = findImpurity(proto, body);
+    if (!impurity.empty()) {
+        string message =
+            "memo def '" + proto.getName() + "' is not pure: " + impurity;
+        logError(message.c_str());
+        return false;
+    }
+    return true;
+}
+
+// memoBits/memoValue - a memo argument or result as the i64 a memo table
+// holds, and back
+static Value* memoBits(Value* V) {
+    Type* i64 = Type::getInt64Ty(*theContext);
+    if (V->getType()->isDoubleTy()) return builder->CreateBitCast(V, i64);
+    if (V->getType()->isIntegerTy(1)) return builder->CreateZExt(V, i64);
+    return V;
+}
+static Value* memoValue(Value* bits, Type* type) {
+    if (type->isDoubleTy()) return builder->CreateBitCast(bits, type);
+    if (type->isIntegerTy(1)) return builder->CreateTrunc(bits, type);
+    return bits;
+}
+// memoTableAddress - the table of a memo def, by the symbol jvavJIT binds it
+// to when the code is linked, in this process or an executor; see
+// memoTableSymbol
+static Constant* memoTableAddress(const string& def) {
+    return theModule->getOrInsertGlobal(memoTableSymbol(def),
+                                        Type::getInt8Ty(*theContext));
+}
+// codegenMemoLookup - look the arguments of theFunction up in table and
+// return the stored result on a hit; leaves the insert point where a miss
+// goes on, and returns the key for codegenMemoStore
+static Value* codegenMemoLookup(Function* theFunction, Value* table) {
+    Type* i64 = Type::getInt64Ty(*theContext);
+    ArrayType* keyTy = ArrayType::get(i64, theFunction->arg_size());
+    AllocaInst* key = createEntryBlockAlloca(theFunction, "memokey", keyTy);
+    AllocaInst* result = createEntryBlockAlloca(theFunction, "memoresult", i64);
+    for (auto& ARG : theFunction->args())
+        builder->CreateStore(
+            memoBits(&ARG),
+            builder->CreateConstInBoundsGEP2_64(keyTy, key, 0, ARG.getArgNo()));
+
+    FunctionCallee lookup = theModule->getOrInsertFunction(
+        "__jvav_memo_lookup", Type::getInt32Ty(*theContext),
+        Type::getInt8PtrTy(*theContext), Type::getInt64PtrTy(*theContext),
+        Type::getInt64PtrTy(*theContext));
+    Value* keyPtr = builder->CreateConstInBoundsGEP2_64(keyTy, key, 0, 0);
+    Value* hit = builder->CreateCall(
+        lookup, {table, keyPtr, result}, "memohit");
+
+    BasicBlock* hitBB = BasicBlock::Create(*theContext, "memohit", theFunction);
+    BasicBlock* missBB = BasicBlock::Create(*theContext, "memomiss", theFunction);
+    builder->CreateCondBr(builder->CreateIsNotNull(hit), hitBB, missBB);
+    builder->SetInsertPoint(hitBB);
+    builder->CreateRet(memoValue(builder->CreateLoad(i64, result, "memoresult"),
+                                 theFunction->getReturnType()));
+    builder->SetInsertPoint(missBB);
+    return keyPtr;
+}
+
+// codegenMemoStore - remember returnValue as the result for key
+static void codegenMemoStore(Value* table, Value* key, Value* returnValue) {
+    FunctionCallee store = theModule->getOrInsertFunction(
+        "__jvav_memo_store", Type::getVoidTy(*theContext),
+        Type::getInt8PtrTy(*theContext), Type::getInt64PtrTy(*theContext),
+        Type::getInt64Ty(*theContext));
+    builder->CreateCall(store, {table, key, memoBits(returnValue)});
+}
+
+Function* functionAST::codegen() {
+    auto& pro = *prototype;
+    functionProtos[prototype->getName()] = move(prototype);
+    // check existing function
+    Function* theFunction = getFunction(pro.getName());
+    if (!theFunction) return NULL;
+
+    // if (!theFunction) theFunction = prototype->codegen();
+
+    // if (!theFunction) return NULL;
+
+    // if (!theFunction->empty()) {
+    //     return (Function*)valueLogError("function connot be redefined");
+    // }
+
+    if (memo && !checkMemo(pro, *body)) {
+        theFunction->eraseFromParent();
+        return NULL;
+    }
+    // the body's own calls see it as a def; undone if the body fails
+    bool wasDefined = definedFunctions.count(pro.getName());
+    bool wasPure = pureFunctions.count(pro.getName());
+    definedFunctions.insert(pro.getName());
+    if (findImpurity(pro, *body).empty())
+        pureFunctions.insert(pro.getName());
+    else
+        pureFunctions.erase(pro.getName());
+
+    // create a new basic block
+    BasicBlock* bb = BasicBlock::Create(*theContext, "entry", theFunction);
+    builder->SetInsertPoint(bb);
+
+    // record function arguments in mutable stack slots
+    namedValues.clear();
+    loopInductions.clear();
+    for (auto& ARG : theFunction->args()) {
+        AllocaInst* alloca = createEntryBlockAlloca(
+            theFunction, string(ARG.getName()), ARG.getType());
+        builder->CreateStore(&ARG, alloca);
+        namedValues[string(ARG.getName())] = alloca;
+    }
+
+    // a memo def answers from its table when it can; its body is no tail,
+    // the result is stored after it
+    Value* table = NULL;
+    Value* memoKey = NULL;
+    if (memo) {
+        // the table itself is made where the def is registered, see
+        // emitDefinition, so the --map copy of a def shares it
+        table = memoTableAddress(pro.getName());
+        memoKey = codegenMemoLookup(theFunction, table);
+    } else {
+        body->markTailPosition();
+    }
+    Value* returnValue = body->codegen();
+    if (returnValue &&
+        !(returnValue = coerceTo(returnValue, theFunction->getReturnType())))
+        returnValue =
+            valueLogError("return value does not match the declared type");
+    if (returnValue) {
+        // finish off the function
+        if (memo) codegenMemoStore(table, memoKey, returnValue);
+        builder->CreateRet(returnValue);
+        verifyFunction(*theFunction);
+        if (optReport)
+            optimizeReported(*theFunction);
+        else
+            theFPM->run(*theFunction);
+        return theFunction;
+    }
+
+    // error reading body, remove function
+    theFunction->eraseFromParent();
+    if (!wasDefined) definedFunctions.erase(pro.getName());
+    if (wasPure)
+        pureFunctions.insert(pro.getName());
+    else
+        pureFunctions.erase(pro.getName());
+    return NULL;
+}
+/**
+ * * 顶级语法分析
+ * * Author: Amiriox
+ * TODO : NULL
+ */
+
+static void initializeModuleAndPassManager() {
+    // open a new context and module
+    theContext = make_unique<LLVMContext>();
+    if (optReport) watchRemarks(*theContext);
+    theModule = std::make_unique<Module>("jvav jit", *theContext);
+    theModule->setDataLayout(theJIT->getDataLayout());
+
+    // create a new builder for the module
+    builder = make_unique<IRBuilder<>>(*theContext);
+    if (fastMath) builder->setFastMathFlags(FastMathFlags::getFast());
+
+    // the session's optimizer carries over from the previous module
+    if (!theFPM)
+        theFPM = make_unique<functionOptimizer>(theJIT->getTargetMachine(),
+                                                theJIT->hasVectorMath(),
+                                                optReport != NULL);
+}
+
+// startEngine - initialize the native target and create theEngine, once per
+// process
+static void startEngine() {
+    static std::once_flag started;
+    std::call_once(started, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+        theEngine = jitEngine::create();
+        if (profileListener)
+            theEngine->getObjectLayer().registerJITEventListener(
+                *profileListener);
+    });
+}
+
+static thread_local string sessionName;  // names the JIT dylib of the session
+
+// ensureBackend - bring up the engine and the session's JIT the first time
+// something has to be compiled, so a run that never compiles anything never
+// pays for LLVM
+static void ensureBackend() {
+    if (theJIT) return;
+    startEngine();
+    theJIT = make_unique<jvavJIT>(*theEngine, sessionName);
+    initializeModuleAndPassManager();
+}
+
+// foldConstant - the value of an expression of nothing but number literals
+// and the operators on them, computed with APFloat exactly as IRBuilder folds
+// it in the generated code (down to the sign of a NaN); false for anything
+// else, which is left to codegen
+static bool foldConstant(exprAST& root, double& value) {
+    vector<const exprAST*> nodes;  // parents before children, left to right
+    bool constant = true;
+    forEachNode(root, [&](exprAST& E) {
+        nodes.push_back(&E);
+        constant = E.getKind() == astNumber ||
+                   (E.getKind() == astBinary &&
+                    strchr("+-*<:", static_cast<binaryExprAST&>(E).getOp()));
+        return constant;
+    });
+    if (!constant) return false;
+
+    // backwards, so each operator finds its left operand on top of the stack
+    // and its right operand below it
+    struct folded {
+        APFloat value;
+        bool isBool;
+    };
+    vector<folded> operands;
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+        if ((*it)->getKind() == astNumber) {
+            operands.push_back(
+                {APFloat(static_cast<const numExprAST*>(*it)->getValue()),
+                 false});
+            continue;
+        }
+        char op = static_cast<const binaryExprAST*>(*it)->getOp();
+        folded L = operands.back();
+        operands.pop_back();
+        folded& R = operands.back();
+        if (op == ':') continue;  // sequence, R is the value
+        if (L.isBool || R.isBool) return false;
+        switch (op) {
+            case '+':
+                L.value.add(R.value, APFloat::rmNearestTiesToEven);
+                R.value = L.value;
+                break;
+            case '-':
+                L.value.subtract(R.value, APFloat::rmNearestTiesToEven);
+                R.value = L.value;
+                break;
+            case '*':
+                L.value.multiply(R.value, APFloat::rmNearestTiesToEven);
+                R.value = L.value;
+                break;
+            case '<': {  // unordered or less than, like fcmp ult
+                auto order = L.value.compare(R.value);
+                bool less = order == APFloat::cmpLessThan ||
+                            order == APFloat::cmpUnordered;
+                R = {APFloat(less ? 1.0 : 0.0), true};
+                break;
+            }
+        }
+    }
+    value = operands.back().value.convertToDouble();
+    return true;
+}
+
+// printIR - print a function to the session output
+static void printIR(Function* F) {
+    string ir;
+    raw_string_ostream irStream(ir);
+    F->print(irStream);
+    fputs(irStream.str().c_str(), sessionOut);
+}
+
+// mapTargetCopy/noteMapTarget - a def serialized if it is the function --map
+// wraps (taken before codegen, which keeps the prototype), and what --map is
+// to wrap once a def of that name has compiled or is forgotten; see runMap
+static string mapTargetCopy(const functionAST& FnAST);
+static void noteMapTarget(const string& name, string copy);
+
+// remoteDefine/remoteForget/remoteRun - load, unload and run object code in
+// the executor processes, see executorPool
+static void remoteDefine(uint64_t object, const string& name, bool memo,
+                         unsigned arity, string bytes);
+static void remoteForget(uint64_t object);
+static bool remoteRun(string bytes, const string& symbol, double& result,
+                      string& output, string& error);
+static void remoteEndSession();
+
+// compileModuleObject - object code of the open module, for the executors;
+// the module is replaced by a fresh one either way
+static string compileModuleObject() {
+    auto obj = theEngine->compile(*theModule);
+    theModule.reset();
+    builder.reset();
+    theContext.reset();
+    initializeModuleAndPassManager();
+    if (!obj) {
+        logError(toString(obj.takeError()).c_str());
+        return string();
+    }
+    return (*obj)->getBuffer().str();
+}
+
+// emitDefinition - generate code for a parsed definition and hand it to the
+// JIT; the IR goes with it and is freed once compiled
+static void emitDefinition(unique_ptr<functionAST> FnAST) {
+    const string& name = FnAST->getPrototype().getName();
+    if (liveDefinitions.count(name)) {
+        logError(("'" + name + "' is already defined, forget it first").c_str());
+        return;
+    }
+    ensureBackend();
+    string mapCopy = mapTargetCopy(*FnAST);
+    bool memo = FnAST->isMemo();
+    if (auto* FnIR = FnAST->codegen()) {
+        noteMapTarget(name, move(mapCopy));
+        fprintf(sessionOut, "Read function definition:");
+        printIR(FnIR);
+        fprintf(sessionOut, "\n");
+        liveDefinition& def = liveDefinitions[FnIR->getName().str()];
+        // every def it may call, also those declared by an extern and
+        // defined later; only the intrinsics and runtime builtins are not
+        for (auto& F : *theModule)
+            if (F.isDeclaration() && !F.isIntrinsic() &&
+                !isRuntimeBuiltin(F.getName()))
+                def.callees.insert(F.getName().str());
+        if (remoteExecution) {
+            static atomic<uint64_t> nextObject{1};
+            def.object = nextObject++;
+            unsigned arity = FnIR->arg_size();  // FnIR goes with the module
+            remoteDefine(def.object, name, memo, arity, compileModuleObject());
+            return;
+        }
+        if (memo) {  // an executor makes its own when it links the def
+            memoTables.push_back(
+                make_unique<memoTable>(FnIR->arg_size(), memoCapacity));
+            def.table = memoTables.back().get();
+        }
+        def.tracker = theJIT->addDefinition(
+            ThreadSafeModule(move(theModule), move(theContext)), name,
+            def.table, keepObjects);
+        initializeModuleAndPassManager();
+    }
+}
+
+// liveCaller - a def other than name and those in going that calls name, or
+// NULL if there is none
+static const string* liveCaller(const string& name,
+                                const set<string>& going) {
+    for (auto& other : liveDefinitions)
+        if (other.first != name && !going.count(other.first) &&
+            other.second.callees.count(name))
+            return &other.first;
+    return NULL;
+}
+
+// releaseDefinition - drop the code, prototype and memo table of a def,
+// whether or not something still calls it
+static void releaseDefinition(const string& name) {
+    auto def = liveDefinitions.find(name);
+    if (remoteExecution)
+        remoteForget(def->second.object);
+    else
+        theJIT->removeModule(def->second.tracker);
+    if (memoTable* table = def->second.table)
+        memoTables.erase(find_if(
+            memoTables.begin(), memoTables.end(),
+            [&](const unique_ptr<memoTable>& T) { return T.get() == table; }));
+    liveDefinitions.erase(def);
+    noteMapTarget(name, string());
+    functionProtos.erase(name);
+    definedFunctions.erase(name);
+    pureFunctions.erase(name);
+    fprintf(sessionOut, "Forgot %s\n", name.c_str());
+}
+
+// emitForget - release a def that no other def calls, after which the name
+// can be defined again
+static void emitForget(const string& name) {
+    if (!liveDefinitions.count(name)) {
+        logError(("cannot forget '" + name + "', it is not a def").c_str());
+        return;
+    }
+    if (const string* caller = liveCaller(name, set<string>())) {
+        logError(("cannot forget '" + name + "', '" + *caller + "' calls it")
+                     .c_str());
+        return;
+    }
+    releaseDefinition(name);
+}
+
+// emitExtern - declare a parsed extern and remember its prototype
+static void emitExtern(unique_ptr<prototypeAST> ProtoAST) {
+    ensureBackend();
+    if (auto* FnIR = ProtoAST->codegen()) {
+        fprintf(sessionOut, "Read extern: ");
+        printIR(FnIR);
+        fprintf(sessionOut, "\n");
+        functionProtos[ProtoAST->getName()] = move(ProtoAST);
+    }
+}
+
+// emitTopLevelExpression - JIT a parsed top-level expression and run it
+static void emitTopLevelExpression(unique_ptr<functionAST> FnAST) {
+    // a constant is answered without compiling, or even starting, anything
+    double constant;
+    if (foldConstant(FnAST->getBody(), constant)) {
+        fprintf(sessionOut, "Evaluated to %f\n", constant);
+        return;
+    }
+    ensureBackend();
+    if (!FnAST->codegen()) return;
+    if (remoteExecution) {
+        double result;
+        string output, error;
+        bool ran = remoteRun(compileModuleObject(), "__anon_expr", result,
+                             output, error);
+        fputs(output.c_str(), sessionOut);
+        if (ran)
+            fprintf(sessionOut, "Evaluated to %f\n", result);
+        else
+            logError(error.c_str());
+        return;
+    }
+
+    //JIT
+    auto H =
+        theJIT->addModule(ThreadSafeModule(move(theModule), move(theContext)));
+    initializeModuleAndPassManager();
+
+    auto exprSymbol = theJIT->findSymbol("__anon_expr");
+    if (exprSymbol) {
+        double (*FP)() = (double (*)())(intptr_t)exprSymbol->getAddress();
+        fprintf(sessionOut, "Evaluated to %f\n", FP());
+    } else {
+        logError(toString(exprSymbol.takeError()).c_str());
+    }
+
+    theJIT->removeModule(H);
+}
+
+// skipToTopLevel - error recovery: drop the rest of a construct that failed
+// to parse, through its ';' or up to the next def, extern or forget, so that
+// its leftover tokens are not parsed (and compiled) as expressions of their own
+static void skipToTopLevel() {
+    while (true) {
+        switch (curTok) {
+            case tokEof:
+            case tokDef:
+            case tokMemo:
+            case tokExtern:
+            case tokForget:
+                return;
+            case ';':
+                getNextToken();
+                return;
+            default:
+                getNextToken();
+        }
+    }
+}
+
+static void HandleDefinition() {
+    parsingItem = true;
+    auto FnAST = parseDefinition();
+    parsingItem = false;
+    if (FnAST)
+        emitDefinition(move(FnAST));
+    else
+        skipToTopLevel();
+}
+
+static void HandleExtern() {
+    parsingItem = true;
+    auto ProtoAST = parseExtern();
+    parsingItem = false;
+    if (ProtoAST)
+        emitExtern(move(ProtoAST));
+    else
+        skipToTopLevel();
+}
+
+static void HandleForget() {
+    parsingItem = true;
+    string name = parseForget();
+    parsingItem = false;
+    if (!name.empty())
+        emitForget(name);
+    else
+        skipToTopLevel();
+}
+
+// saveSnapshot - write what the session has compiled to path, see :save
+static bool saveSnapshot(const string& path);
+
+// HandleCommand - a line starting with ':', in the REPL or a source file run
+// by it; :save <file> writes a snapshot of the session for --restore
+static void HandleCommand() {
+    getNextToken();  // eat ':'
+    string command = curTok == tokIdentifier ? identifierStr : string();
+    string argument = lexRestOfLine();
+    getNextToken();
+    if (command == "save" && !argument.empty())
+        saveSnapshot(argument);
+    else
+        logError("unknown command, expected :save <file>");
+}
+
+static void HandleTopLevelExpression() {
+    // Evaluate a top-level expression into an anonymous function.
+    parsingItem = true;
+    auto FnAST = parseTopLevelExpr();
+    parsingItem = false;
+    if (FnAST)
+        emitTopLevelExpression(move(FnAST));
+    else
+        skipToTopLevel();
+}
+
+/// top ::= definition | external | expression | ';' | ':' command
+static void MainLoop() {
+    while (true) {
+        if (sessionPrompt) fprintf(sessionOut, "ready> ");
+        switch (curTok) {
+            case tokEof:
+                return;
+            case ';':  // ignore top-level semicolons.
+                getNextToken();
+                break;
+            case ':':
+                HandleCommand();
+                break;
+            case tokDef:
+            case tokMemo:
+                HandleDefinition();
+                break;
+            case tokExtern:
+                HandleExtern();
+                break;
+            case tokForget:
+                HandleForget();
+                break;
+            default:
+                HandleTopLevelExpression();
+                break;
+        }
+    }
+}
+/**
+ * * 库函数
+ * * Author: Amiriox
+ * TODO : NULL
+ */
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+  fputc((char)X, sessionOut);
+  return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+/// One fprintf per call, so lines printed from parfor never interleave.
+extern "C" DLLEXPORT double printd(double X) {
+  fprintf(sessionOut, "%f\n", X);
+  return 0;
+}
+
+// inParallelRegion - whether this thread is running a parfor or parsum body;
+// a nested parfor runs on the thread that calls it
+static thread_local bool inParallelRegion = false;
+
+// workPool - process wide threads that run parfor and parsum. The range of a
+// job is cut into chunks, each participant (the workers and the calling
+// thread) starts on its own contiguous share of them and, once that is done,
+// steals chunks from the back of the others' shares. The sum is taken chunk
+// by chunk in order, so it does not depend on who ran what.
+class workPool {
+   private:
+    struct share {
+        mutex lock;
+        int64_t next = 0, end = 0;  // chunks not yet taken
+    };
+    struct job {
+        double (*body)(int64_t);
+        int64_t begin, end, chunkSize;
+        FILE* out;  // sessionOut of the caller, for printd and putchard
+        unique_ptr<share[]> shares;
+        vector<double> partials;  // one per chunk
+    };
+
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake, idle;
+    job* current = NULL;
+    uint64_t generation = 0;
+    unsigned busy = 0;  // workers inside current
+    bool stopping = false;
+    mutex runLock;  // one job at a time
+
+    static bool takeFront(share& S, int64_t& chunk) {
+        lock_guard<mutex> guard(S.lock);
+        if (S.next == S.end) return false;
+        chunk = S.next++;
+        return true;
+    }
+    static bool takeBack(share& S, int64_t& chunk) {
+        lock_guard<mutex> guard(S.lock);
+        if (S.next == S.end) return false;
+        chunk = --S.end;
+        return true;
+    }
+    static void runChunk(job& J, int64_t chunk) {
+        int64_t lo = J.begin + chunk * J.chunkSize;
+        int64_t hi = min(J.end, lo + J.chunkSize);
+        double sum = 0;
+        for (int64_t i = lo; i < hi; ++i) sum += J.body(i);
+        J.partials[chunk] = sum;
+    }
+    void participate(job& J, unsigned self) {
+        unsigned participants = threads.size() + 1;
+        int64_t chunk;
+        while (true) {
+            bool found = takeFront(J.shares[self], chunk);
+            for (unsigned k = 1; k < participants && !found; ++k)
+                found = takeBack(J.shares[(self + k) % participants], chunk);
+            if (!found) return;
+            runChunk(J, chunk);
+        }
+    }
+    void workerLoop(unsigned self) {
+        inParallelRegion = true;
+        uint64_t seen = 0;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] {
+                return stopping || (current && generation != seen);
+            });
+            if (stopping) return;
+            seen = generation;
+            job& J = *current;
+            ++busy;
+            guard.unlock();
+            sessionOut = J.out;
+            participate(J, self);
+            guard.lock();
+            if (--busy == 0) idle.notify_all();
+        }
+    }
+
+   public:
+    explicit workPool(unsigned workers) {
+        for (unsigned i = 1; i <= workers; ++i)
+            threads.emplace_back([this, i] { workerLoop(i); });
+    }
+    ~workPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& T : threads) T.join();
+    }
+
+    double run(double (*body)(int64_t), int64_t begin, int64_t end) {
+        if (end <= begin) return 0;
+        if (inParallelRegion || threads.empty()) {
+            double sum = 0;
+            for (int64_t i = begin; i < end; ++i) sum += body(i);
+            return sum;
+        }
+        lock_guard<mutex> serial(runLock);
+
+        // a few chunks per participant, so a slow one can be helped out
+        unsigned participants = threads.size() + 1;
+        uint64_t count = (uint64_t)end - (uint64_t)begin;
+        uint64_t chunks = min<uint64_t>(count, participants * 8);
+        job J;
+        J.body = body;
+        J.begin = begin;
+        J.end = end;
+        J.chunkSize = (count + chunks - 1) / chunks;
+        chunks = (count + J.chunkSize - 1) / J.chunkSize;
+        J.out = sessionOut;
+        J.shares.reset(new share[participants]);
+        for (unsigned p = 0; p < participants; ++p) {
+            J.shares[p].next = chunks * p / participants;
+            J.shares[p].end = chunks * (p + 1) / participants;
+        }
+        J.partials.resize(chunks);
+
+        {
+            lock_guard<mutex> guard(lock);
+            current = &J;
+            ++generation;
+        }
+        wake.notify_all();
+        inParallelRegion = true;
+        participate(J, 0);
+        inParallelRegion = false;
+        {
+            unique_lock<mutex> guard(lock);
+            current = NULL;
+            idle.wait(guard, [&] { return busy == 0; });
+        }
+
+        double sum = 0;
+        for (double partial : J.partials) sum += partial;
+        return sum;
+    }
+};
+
+// parallelThreads - --threads, the threads parfor runs on; 0 for one per core
+static unsigned parallelThreads = 0;
+
+// parallelSum - runs body over [begin, end) on the work pool, which is
+// started on first use
+static double parallelSum(double (*body)(int64_t), int64_t begin,
+                          int64_t end) {
+    static workPool pool(
+        max(1u, parallelThreads ? parallelThreads
+                                : thread::hardware_concurrency()) - 1);
+    return pool.run(body, begin, end);
+}
+
+/**
+ * * 会话
+ * * Author: Amiriox
+ * TODO : NULL
+ */
+// installBinaryOperators - the standard binary operators, 1 is lowest
+static void installBinaryOperators() {
+    BinOpPrecedence.clear();
+    BinOpPrecedence[':'] = 1;  // sequence
+    BinOpPrecedence['='] = 2;  // assignment
+    BinOpPrecedence['<'] = 10;
+    BinOpPrecedence['+'] = 20;
+    BinOpPrecedence['-'] = 30;
+    BinOpPrecedence['*'] = 40;  //highest
+}
+
+// beginSession - reset the front end of the calling thread, reading from in
+// and writing everything to out; its JIT dylib, called name, comes with the
+// first thing it compiles
+static void beginSession(FILE* in, FILE* out, bool prompt,
+                         const string& name) {
+    sessionIn = in;
+    sessionOut = out;
+    sessionPrompt = prompt;
+    resetLexer();
+    installBinaryOperators();
+    functionProtos.clear();
+    definedFunctions.clear();
+    pureFunctions.clear();
+    liveDefinitions.clear();
+    keepObjects = savable && !remoteExecution;
+    sessionName = name;  // the JIT is started by ensureBackend
+    static atomic<uint64_t> sessions{0};
+    sessionId = ++sessions;
+}
+
+static bool memReport = false;  // --mem-report, see printMemoryReport
+static void printMemoryReport();
+
+// endSession - release everything the session compiled
+static void endSession() {
+    if (memReport) printMemoryReport();
+    if (optReport) writeOptReport();
+    if (remoteExecution) remoteEndSession();
+    theFPM.reset();
+    theModule.reset();
+    builder.reset();
+    theContext.reset();
+    namedValues.clear();
+    functionProtos.clear();
+    definedFunctions.clear();
+    pureFunctions.clear();
+    liveDefinitions.clear();
+    theJIT.reset();
+    memoTables.clear();
+    fflush(sessionOut);
+}
+
+/**
+ * * 流水线模式
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * jvavc --pipeline file.jv: 词法/语法分析在独立线程中运行,
+ *   * 通过有界无锁队列把顶级语法树交给主线程做 codegen/优化/JIT/执行
+ *   * 队列是先进先出的单生产者单消费者队列, 所以顶级表达式的副作用顺序不变
+ * !}
+ */
+// topLevelItem - one parsed top-level construct on its way to codegen
+struct topLevelItem {
+    enum kindTy { itemDef, itemExtern, itemExpr, itemForget, itemEof } kind =
+        itemEof;
+    unique_ptr<functionAST> function;    // itemDef, itemExpr
+    unique_ptr<prototypeAST> prototype;  // itemExtern
+    string name;                         // itemForget
+    string diagnostics;  // syntax errors met on the way to it, see parseStage
+};
+
+// spscQueue - bounded lock-free single producer single consumer ring buffer
+template <typename T, size_t Capacity>
+class spscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0,
+                  "capacity must be a power of two");
+
+   private:
+    T slots[Capacity];
+    alignas(64) atomic<size_t> head{0};  // next slot to pop, consumer owned
+    alignas(64) atomic<size_t> tail{0};  // next slot to push, producer owned
+
+   public:
+    bool tryPush(T& item) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == Capacity) return false;
+        slots[t & (Capacity - 1)] = move(item);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+    bool tryPop(T& item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        item = move(slots[h & (Capacity - 1)]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+    // push/pop - spin, yielding the core, until the other stage catches up
+    void push(T item) {
+        while (!tryPush(item)) this_thread::yield();
+    }
+    T pop() {
+        T item;
+        while (!tryPop(item)) this_thread::yield();
+        return item;
+    }
+};
+
+typedef spscQueue<topLevelItem, 256> itemQueue;
+
+// parseTopLevelItem - parse the next top-level construct after curTok,
+// skipping semicolons and anything that fails to parse; itemEof at the end
+static topLevelItem parseTopLevelItem() {
+    while (curTok != tokEof) {
+        if (curTok == ';') {  // ignore top-level semicolons.
+            getNextToken();
+            continue;
+        }
+        if (curTok == ':') {
+            // a command runs in between items, which only MainLoop reads
+            // one at a time; its argument is no tokens
+            parsingItem = true;
+            logError("commands such as :save are only read by the REPL and "
+                     "plain source runs");
+            parsingItem = false;
+            lexRestOfLine();
+            getNextToken();
+            continue;
+        }
+        topLevelItem item;
+        parsingItem = true;
+        switch (curTok) {
+            case tokDef:
+            case tokMemo:
+                item.kind = topLevelItem::itemDef;
+                item.function = parseDefinition();
+                break;
+            case tokExtern:
+                item.kind = topLevelItem::itemExtern;
+                item.prototype = parseExtern();
+                break;
+            case tokForget:
+                item.kind = topLevelItem::itemForget;
+                item.name = parseForget();
+                break;
+            default:
+                item.kind = topLevelItem::itemExpr;
+                item.function = parseTopLevelExpr();
+                break;
+        }
+        parsingItem = false;
+        if (item.function || item.prototype || !item.name.empty()) return item;
+        skipToTopLevel();
+    }
+    return topLevelItem();
+}
+
+// emitTopLevelItem - run the back end on one parsed item
+static void emitTopLevelItem(topLevelItem item) {
+    switch (item.kind) {
+        case topLevelItem::itemDef:
+            emitDefinition(move(item.function));
+            break;
+        case topLevelItem::itemExtern:
+            emitExtern(move(item.prototype));
+            break;
+        case topLevelItem::itemExpr:
+            emitTopLevelExpression(move(item.function));
+            break;
+        case topLevelItem::itemForget:
+            emitForget(item.name);
+            break;
+        case topLevelItem::itemEof:
+            break;
+    }
+}
+
+// captureOutput - run emit with the session output going to a string
+template <typename F>
+static string captureOutput(F emit) {
+    char* text = NULL;
+    size_t length = 0;
+    FILE* out = sessionOut;
+    FILE* capture = open_memstream(&text, &length);
+    if (!capture) {
+        emit();
+        return string();
+    }
+    sessionOut = capture;
+    emit();
+    fclose(capture);
+    sessionOut = out;
+    string captured(text, length);
+    free(text);
+    return captured;
+}
+
+// parseStage - producer: lex and parse the whole input into the queue; the
+// syntax errors travel with the item after them, so the consumer prints them
+// in the order of a sequential run
+static void parseStage(FILE* in, FILE* out, itemQueue& queue) {
+    sessionIn = in;
+    sessionOut = out;
+    sessionPrompt = false;
+    resetLexer();
+    installBinaryOperators();
+
+    getNextToken();
+    while (true) {
+        topLevelItem item;
+        string diagnostics =
+            captureOutput([&] { item = parseTopLevelItem(); });
+        item.diagnostics = move(diagnostics);
+        bool last = item.kind == topLevelItem::itemEof;
+        queue.push(move(item));
+        if (last) return;
+    }
+}
+
+// runPipelined - consumer: codegen, optimize, JIT and run items in order
+static void runPipelined(FILE* in) {
+    unique_ptr<itemQueue> queue = make_unique<itemQueue>();
+    thread parser(parseStage, in, sessionOut, ref(*queue));
+
+    while (true) {
+        topLevelItem item = queue->pop();
+        fputs(item.diagnostics.c_str(), sessionOut);
+        if (item.kind == topLevelItem::itemEof) break;
+        emitTopLevelItem(move(item));
+    }
+    parser.join();
+}
+
+/**
+ * * 并发求值模式
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * jvavc --concurrent file.jv: 定义和 extern 照常按顺序编译,
+ *   * 纯的顶级表达式 (只调用纯函数, 见 findImpurity) 彼此独立,
+ *   * 交给执行线程并发地 JIT 和执行, 主线程继续编译后面的顶级项
+ *   * 调用 printd 等有副作用的表达式是顺序边: 先输出它之前的所有结果,
+ *   * 再在主线程上执行; 所有输出仍按源代码顺序
+ * !}
+ */
+// scriptItem - one top-level item of a --concurrent script: what parsing and
+// compiling it printed and, for a pure expression, its result
+struct scriptItem {
+    string output;
+    string symbol;  // the expression function, empty if nothing runs
+    ResourceTrackerSP tracker;
+    jvavJIT* jit = NULL;
+    string object;  // its object code instead, with remoteExecution
+    uint64_t session = 0;  // to run in this session
+    double result = 0;
+    string error;
+    bool done = false;
+};
+
+// scriptRunners - threads that JIT and run pure expressions in the order
+// they are submitted
+class scriptRunners {
+   private:
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake, finished;
+    deque<scriptItem*> queue;
+    bool stopping = false;
+
+    void runnerLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            scriptItem* item = queue.front();
+            queue.pop_front();
+            guard.unlock();
+
+            double result = 0;
+            string output, error;
+            if (remoteExecution) {
+                sessionId = item->session;  // runners serve one session
+                remoteRun(move(item->object), item->symbol, result, output,
+                          error);
+            } else {
+                auto exprSymbol = item->jit->findSymbol(item->symbol);
+                if (exprSymbol)
+                    result =
+                        ((double (*)())(intptr_t)exprSymbol->getAddress())();
+                else
+                    error = toString(exprSymbol.takeError());
+            }
+
+            guard.lock();
+            item->output += output;
+            item->result = result;
+            item->error = move(error);
+            item->done = true;
+            finished.notify_all();
+        }
+    }
+
+   public:
+    explicit scriptRunners(unsigned count) {
+        for (unsigned i = 0; i < count; ++i)
+            threads.emplace_back([this] { runnerLoop(); });
+    }
+    ~scriptRunners() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& T : threads) T.join();
+    }
+
+    void submit(scriptItem& item) {
+        {
+            lock_guard<mutex> guard(lock);
+            queue.push_back(&item);
+        }
+        wake.notify_one();
+    }
+    // finish - whether item has run, after waiting for it if block is set
+    bool finish(scriptItem& item, bool block) {
+        unique_lock<mutex> guard(lock);
+        if (block) finished.wait(guard, [&] { return item.done; });
+        return item.done;
+    }
+};
+
+// compileScriptExpression - add a pure top-level expression to the JIT under
+// a name of its own, so it can be run while later items are compiled
+static void compileScriptExpression(unique_ptr<functionAST> FnAST,
+                                    scriptItem& item, unsigned id) {
+    ensureBackend();
+    Function* FnIR = FnAST->codegen();
+    if (!FnIR) return;
+    item.symbol = "__anon_expr." + to_string(id);
+    FnIR->setName(item.symbol);
+    if (remoteExecution) {
+        item.object = compileModuleObject();
+        item.session = sessionId;
+        return;
+    }
+    item.tracker =
+        theJIT->addModule(ThreadSafeModule(move(theModule), move(theContext)));
+    initializeModuleAndPassManager();
+    item.jit = theJIT.get();
+}
+
+// runConcurrent - the main loop of --concurrent
+static void runConcurrent() {
+    unsigned threads = parallelThreads ? parallelThreads
+                                       : max(1u, thread::hardware_concurrency());
+    scriptRunners runners(threads);
+    deque<scriptItem> items;  // not yet printed, in source order
+
+    // flush - print the items that have finished, or all of them if block
+    auto flush = [&](bool block) {
+        while (!items.empty()) {
+            scriptItem& item = items.front();
+            if (!item.symbol.empty() && !runners.finish(item, block)) return;
+            fputs(item.output.c_str(), sessionOut);
+            if (!item.symbol.empty()) {
+                if (item.error.empty())
+                    fprintf(sessionOut, "Evaluated to %f\n", item.result);
+                else
+                    logError(item.error.c_str());
+                if (item.tracker) theJIT->removeModule(item.tracker);
+            }
+            items.pop_front();
+        }
+    };
+
+    unsigned expressions = 0;
+    getNextToken();
+    while (true) {
+        topLevelItem parsed;
+        string output = captureOutput([&] { parsed = parseTopLevelItem(); });
+        if (parsed.kind == topLevelItem::itemEof) {
+            flush(true);
+            fputs(output.c_str(), sessionOut);
+            break;
+        }
+        if ((parsed.kind == topLevelItem::itemExpr &&
+             !parsed.function->isPure()) ||
+            parsed.kind == topLevelItem::itemForget) {
+            // an ordering edge: everything before it is printed first, and
+            // nothing still running calls what forget releases
+            flush(true);
+            fputs(output.c_str(), sessionOut);
+            emitTopLevelItem(move(parsed));
+            continue;
+        }
+
+        items.emplace_back();
+        scriptItem& item = items.back();
+        item.output = move(output);
+        item.output += captureOutput([&] {
+            if (parsed.kind == topLevelItem::itemExpr)
+                compileScriptExpression(move(parsed.function), item,
+                                        expressions++);
+            else
+                emitTopLevelItem(move(parsed));
+        });
+        if (!item.symbol.empty()) runners.submit(item);
+        flush(false);
+    }
+}
+
+/**
+ * * 语法树缓存
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * jvavc --prelude lib.jv: 第一次运行时把 lib.jv 的顶级语法树和运算符优先级
+ *   * 序列化到缓存目录, 缓存文件名是源文件内容的哈希值
+ *   * 源文件不变时直接 mmap 缓存文件并反序列化, 跳过词法与语法分析
+ * !}
+ */
+// astWriter - appends the compact binary form of syntax trees: one tag byte
+// per node, LEB128 counts and string lengths, raw little endian doubles
+class astWriter {
+   private:
+    string bytes;
+
+   public:
+    void writeByte(uint8_t b) { bytes.push_back((char)b); }
+    void writeCount(uint64_t n) {
+        do {
+            uint8_t b = n & 0x7f;
+            n >>= 7;
+            writeByte(n ? b | 0x80 : b);
+        } while (n);
+    }
+    void writeDouble(double d) {
+        char raw[sizeof(d)];
+        memcpy(raw, &d, sizeof(d));
+        bytes.append(raw, sizeof(raw));
+    }
+    void writeString(const string& str) {
+        writeCount(str.size());
+        bytes += str;
+    }
+    const string& getBytes() const { return bytes; }
+};
+
+// astReader - reads what astWriter wrote; running off the end or meeting a
+// malformed count marks the reader failed instead of reading out of bounds
+class astReader {
+   private:
+    const char* cur;
+    const char* end;
+    bool failed = false;
+
+   public:
+    astReader(const char* begin, const char* finish) : cur(begin), end(finish) {}
+    bool ok() const { return !failed; }
+    size_t remaining() const { return end - cur; }
+    uint8_t peekByte() const { return cur == end ? 0 : (uint8_t)*cur; }
+    uint8_t readByte() {
+        if (cur == end) {
+            failed = true;
+            return 0;
+        }
+        return (uint8_t)*cur++;
+    }
+    uint64_t readCount() {
+        uint64_t n = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            uint8_t b = readByte();
+            n |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) return n;
+        }
+        failed = true;
+        return 0;
+    }
+    double readDouble() {
+        double d = 0;
+        if (remaining() < sizeof(d)) {
+            failed = true;
+            return 0;
+        }
+        memcpy(&d, cur, sizeof(d));
+        cur += sizeof(d);
+        return d;
+    }
+    string readString() {
+        uint64_t n = readCount();
+        if (n > remaining()) {
+            failed = true;
+            return string();
+        }
+        string str(cur, n);
+        cur += n;
+        return str;
+    }
+};
+
+void numExprAST::serialize(astWriter& W) const {
+    W.writeByte(astNumber);
+    W.writeDouble(Val);
+}
+void variableExprAST::serialize(astWriter& W) const {
+    W.writeByte(astVariable);
+    W.writeString(name);
+}
+void indexExprAST::serialize(astWriter& W) const {
+    W.writeByte(astIndex);
+    W.writeString(name);
+    index->serialize(W);
+}
+void binaryExprAST::serialize(astWriter& W) const {
+    // prefix order: tag, operator, LHS, RHS, with nested operators written
+    // from an explicit stack
+    vector<const exprAST*> pending{this};
+    while (!pending.empty()) {
+        const exprAST* E = pending.back();
+        pending.pop_back();
+        if (!isOperatorChain(E)) {
+            E->serialize(W);
+            continue;
+        }
+        auto* B = static_cast<const binaryExprAST*>(E);
+        W.writeByte(astBinary);
+        W.writeByte((uint8_t)B->op);
+        pending.push_back(B->RHS.get());
+        pending.push_back(B->LHS.get());
+    }
+}
+void callExprAST::serialize(astWriter& W) const {
+    W.writeByte(astCall);
+    W.writeString(callee);
+    W.writeCount(args.size());
+    for (auto& arg : args) arg->serialize(W);
+}
+void ifExprAST::serialize(astWriter& W) const {
+    W.writeByte(astIf);
+    cond->serialize(W);
+    then->serialize(W);
+    otherwise->serialize(W);
+}
+void forExprAST::serialize(astWriter& W) const {
+    W.writeByte(astFor);
+    W.writeString(varName);
+    W.writeByte(varType);
+    start->serialize(W);
+    end->serialize(W);
+    W.writeByte(step ? 1 : 0);
+    if (step) step->serialize(W);
+    body->serialize(W);
+}
+void varExprAST::serialize(astWriter& W) const {
+    W.writeByte(astVar);
+    W.writeCount(varNames.size());
+    for (auto& var : varNames) {
+        W.writeString(var.name);
+        W.writeByte(var.declared ? var.type + 1 : 0);  // 0 when inferred
+        W.writeByte(var.init ? 1 : 0);
+        if (var.init) var.init->serialize(W);
+    }
+    body->serialize(W);
+}
+void prototypeAST::serialize(astWriter& W) const {
+    W.writeString(name);
+    W.writeCount(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        W.writeString(args[i]);
+        W.writeByte(argTypes[i]);
+    }
+    W.writeByte(retType);
+}
+void functionAST::serialize(astWriter& W) const {
+    W.writeByte(memo);
+    prototype->serialize(W);
+    body->serialize(W);
+}
+
+static unique_ptr<exprAST> deserializeExpr(astReader& R) {
+    switch (R.readByte()) {
+        case astNumber:
+            return make_unique<numExprAST>(R.readDouble());
+        case astVariable:
+            return make_unique<variableExprAST>(R.readString());
+        case astIndex: {
+            string name = R.readString();
+            auto index = deserializeExpr(R);
+            if (!index) return NULL;
+            return make_unique<indexExprAST>(name, move(index));
+        }
+        case astBinary: {
+            // nested operators are read with an explicit stack of the ones
+            // still waiting for operands
+            struct openOp {
+                char op;
+                unique_ptr<exprAST> LHS;  // once read
+            };
+            vector<openOp> open;
+            open.push_back({(char)R.readByte(), NULL});
+            while (R.ok()) {
+                while (R.peekByte() == astBinary && R.ok()) {
+                    R.readByte();
+                    open.push_back({(char)R.readByte(), NULL});
+                }
+                auto operand = deserializeExpr(R);
+                if (!operand) return NULL;
+                while (open.back().LHS) {
+                    operand = make_unique<binaryExprAST>(
+                        open.back().op, move(open.back().LHS), move(operand));
+                    open.pop_back();
+                    if (open.empty()) return operand;
+                }
+                open.back().LHS = move(operand);
+            }
+            return NULL;
+        }
+        case astCall: {
+            string callee = R.readString();
+            uint64_t count = R.readCount();
+            if (count > R.remaining()) return NULL;  // every node is >= 1 byte
+            vector<unique_ptr<exprAST>> args;
+            for (uint64_t i = 0; i < count; ++i) {
+                if (auto arg = deserializeExpr(R))
+                    args.push_back(move(arg));
+                else
+                    return NULL;
+            }
+            return make_unique<callExprAST>(callee, move(args));
+        }
+        case astIf: {
+            auto cond = deserializeExpr(R);
+            if (!cond) return NULL;
+            auto then = deserializeExpr(R);
+            if (!then) return NULL;
+            auto otherwise = deserializeExpr(R);
+            if (!otherwise) return NULL;
+            return make_unique<ifExprAST>(move(cond), move(then),
+                                          move(otherwise));
+        }
+        case astFor: {
+            string varName = R.readString();
+            uint8_t varType = R.readByte();
+            if (varType != tyDouble && varType != tyI64) return NULL;
+            auto start = deserializeExpr(R);
+            if (!start) return NULL;
+            auto end = deserializeExpr(R);
+            if (!end) return NULL;
+            unique_ptr<exprAST> step;
+            if (R.readByte() && !(step = deserializeExpr(R))) return NULL;
+            auto body = deserializeExpr(R);
+            if (!body) return NULL;
+            return make_unique<forExprAST>(varName, (valueType)varType,
+                                           move(start), move(end), move(step),
+                                           move(body));
+        }
+        case astVar: {
+            uint64_t count = R.readCount();
+            if (count > R.remaining()) return NULL;
+            vector<varBinding> varNames;
+            for (uint64_t i = 0; i < count; ++i) {
+                varBinding var;
+                var.name = R.readString();
+                uint8_t type = R.readByte();
+                if (type > tyBool + 1) return NULL;
+                var.declared = type != 0;
+                if (var.declared) var.type = (valueType)(type - 1);
+                if (R.readByte() && !(var.init = deserializeExpr(R)))
+                    return NULL;
+                varNames.push_back(move(var));
+            }
+            auto body = deserializeExpr(R);
+            if (!body) return NULL;
+            return make_unique<varExprAST>(move(varNames), move(body));
+        }
+        default:
+            return NULL;
+    }
+}
+
+static unique_ptr<prototypeAST> deserializePrototype(astReader& R) {
+    string name = R.readString();
+    uint64_t count = R.readCount();
+    if (count > R.remaining()) return NULL;
+    vector<string> args;
+    vector<valueType> argTypes;
+    for (uint64_t i = 0; i < count; ++i) {
+        args.push_back(R.readString());
+        uint8_t type = R.readByte();
+        if (type > tyBool) return NULL;
+        argTypes.push_back((valueType)type);
+    }
+    uint8_t retType = R.readByte();
+    if (!R.ok() || retType > tyBool) return NULL;
+    return make_unique<prototypeAST>(name, move(args), move(argTypes),
+                                     (valueType)retType);
+}
+
+static unique_ptr<functionAST> deserializeFunction(astReader& R) {
+    uint8_t memo = R.readByte();
+    if (memo > 1) return NULL;
+    auto prototype = deserializePrototype(R);
+    if (!prototype) return NULL;
+    auto body = deserializeExpr(R);
+    if (!body) return NULL;
+    return make_unique<functionAST>(move(prototype), move(body), memo);
+}
+
+// mappedFile - read only mmap of a whole file
+class mappedFile {
+   private:
+    void* data = MAP_FAILED;
+    size_t size = 0;
+
+   public:
+    explicit mappedFile(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = st.st_size;
+            data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+    }
+    ~mappedFile() {
+        if (data != MAP_FAILED) munmap(data, size);
+    }
+    bool valid() const { return data != MAP_FAILED; }
+    const char* begin() const { return (const char*)data; }
+    const char* end() const { return begin() + size; }
+    StringRef contents() const { return StringRef(begin(), size); }
+};
+
+static const char astCacheMagic[8] = {'J', 'V', 'A', 'V', 'A', 'S', 'T', 6};
+
+// defaultAstCacheDir - $XDG_CACHE_HOME/jvavc, or ~/.cache/jvavc
+static string defaultAstCacheDir() {
+    if (const char* xdg = getenv("XDG_CACHE_HOME")) return string(xdg) + "/jvavc";
+    if (const char* home = getenv("HOME")) return string(home) + "/.cache/jvavc";
+    return ".jvavc-cache";
+}
+
+// readAstCache - the items and operator table cached for a source hash, or
+// false if there is no usable cache file
+static bool readAstCache(const string& cachePath, uint64_t sourceHash,
+                         vector<topLevelItem>& items) {
+    mappedFile cache(cachePath);
+    if (!cache.valid()) return false;
+
+    astReader R(cache.begin(), cache.end());
+    char magic[sizeof(astCacheMagic)];
+    for (char& c : magic) c = (char)R.readByte();
+    if (memcmp(magic, astCacheMagic, sizeof(magic)) ||
+        R.readCount() != sourceHash)
+        return false;
+
+    map<char, int> precedence;
+    for (uint64_t i = 0, n = R.readCount(); i < n && R.ok(); ++i) {
+        char op = (char)R.readByte();
+        precedence[op] = (int)R.readCount();
+    }
+    for (uint64_t i = 0, n = R.readCount(); i < n && R.ok(); ++i) {
+        topLevelItem item;
+        item.kind = (topLevelItem::kindTy)R.readByte();
+        if (item.kind == topLevelItem::itemExtern)
+            item.prototype = deserializePrototype(R);
+        else if (item.kind == topLevelItem::itemDef ||
+                 item.kind == topLevelItem::itemExpr)
+            item.function = deserializeFunction(R);
+        else if (item.kind == topLevelItem::itemForget)
+            item.name = R.readString();
+        if (!item.function && !item.prototype && item.name.empty())
+            return false;
+        items.push_back(move(item));
+    }
+    if (!R.ok() || R.remaining()) return false;
+
+    BinOpPrecedence = move(precedence);
+    return true;
+}
+
+// writeAstCache - store items under cachePath, atomically via a rename
+static void writeAstCache(const string& cachePath, uint64_t sourceHash,
+                          const vector<topLevelItem>& items) {
+    astWriter W;
+    for (char c : astCacheMagic) W.writeByte(c);
+    W.writeCount(sourceHash);
+    W.writeCount(BinOpPrecedence.size());
+    for (auto& op : BinOpPrecedence) {
+        W.writeByte((uint8_t)op.first);
+        W.writeCount(op.second);
+    }
+    W.writeCount(items.size());
+    for (auto& item : items) {
+        W.writeByte(item.kind);
+        if (item.prototype)
+            item.prototype->serialize(W);
+        else if (item.function)
+            item.function->serialize(W);
+        else
+            W.writeString(item.name);
+    }
+
+    string tmpPath = cachePath + ".tmp" + to_string(getpid());
+    FILE* out = fopen(tmpPath.c_str(), "wb");
+    if (!out) return;  // the cache is only an optimization
+    bool written = fwrite(W.getBytes().data(), 1, W.getBytes().size(), out) ==
+                   W.getBytes().size();
+    if (fclose(out) == 0 && written)
+        rename(tmpPath.c_str(), cachePath.c_str());
+    else
+        unlink(tmpPath.c_str());
+}
+
+// loadPrelude - run every top-level item of path, deserialized from the AST
+// cache when the source is unchanged and parsed (filling the cache) otherwise
+static bool loadPrelude(const char* path, const string& cacheDir) {
+    if (access(path, R_OK) != 0) {
+        perror(path);
+        return false;
+    }
+    mappedFile source(path);  // not valid() for an empty prelude
+    uint64_t sourceHash =
+        xxHash64(source.valid() ? source.contents() : StringRef());
+    char hashName[32];
+    snprintf(hashName, sizeof(hashName), "/%016llx.jvast",
+             (unsigned long long)sourceHash);
+    string cachePath = cacheDir + hashName;
+
+    vector<topLevelItem> items;
+    if (!readAstCache(cachePath, sourceHash, items)) {
+        items.clear();
+        FILE* in = fopen(path, "r");
+        if (!in) {
+            perror(path);
+            return false;
+        }
+        FILE* savedIn = sessionIn;
+        unsigned savedErrors = errorCount;
+        sessionIn = in;
+        resetLexer();
+        getNextToken();
+        for (topLevelItem item = parseTopLevelItem();
+             item.kind != topLevelItem::itemEof; item = parseTopLevelItem())
+            items.push_back(move(item));
+        sessionIn = savedIn;
+        resetLexer();
+        fclose(in);
+
+        // a prelude with syntax errors is not cached, so that the errors are
+        // reported again on the next run
+        if (errorCount == savedErrors) {
+            for (size_t slash = cacheDir.find('/', 1); slash != string::npos;
+                 slash = cacheDir.find('/', slash + 1))
+                mkdir(cacheDir.substr(0, slash).c_str(), 0755);
+            mkdir(cacheDir.c_str(), 0755);
+            writeAstCache(cachePath, sourceHash, items);
+        }
+    }
+
+    for (auto& item : items) emitTopLevelItem(move(item));
+    return true;
+}
+
+/**
+ * * 会话快照
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * :save session.snap 把会话的运算符优先级, 全部原型以及每个 def 的目标文件
+ *   * (可重定位的 ELF, 不是内存映像) 写入快照
+ *   * jvavc --restore session.snap 在会话开始时载入快照: 不做词法分析,
+ *   * 语法分析, 优化或代码生成, def 的目标文件在第一次调用时链接
+ *   * 目标文件是为本机 CPU 编译的, 快照只能在同样的目标上恢复
+ * !}
+ */
+static const char snapshotMagic[8] = {'J', 'V', 'A', 'V', 'S', 'N', 'P', 1};
+static const char* restorePath = NULL;  // --restore, for every session
+
+// snapshotTarget - what the object code of a snapshot was compiled for
+static string snapshotTarget() {
+    TargetMachine& TM = theJIT->getTargetMachine();
+    return TM.getTargetTriple().str() + " " + TM.getTargetCPU().str() + " " +
+           TM.getTargetFeatureString().str();
+}
+
+// snapshotFlags - what a snapshot notes of each prototype
+enum snapshotFlags : uint8_t {
+    snapDefined = 1,
+    snapPure = 2,
+};
+
+static bool saveSnapshot(const string& path) {
+    if (remoteExecution || !keepObjects) {
+        logError(remoteExecution ? "cannot save a session whose code runs in "
+                                   "executors"
+                 : !savable      ? "cannot save a session not started with "
+                                   "--savable"
+                                 : "cannot save a served session");
+        return false;
+    }
+    ensureBackend();
+    astWriter W;
+    for (char c : snapshotMagic) W.writeByte(c);
+    W.writeString(snapshotTarget());
+    W.writeCount(BinOpPrecedence.size());
+    for (auto& op : BinOpPrecedence) {
+        W.writeByte((uint8_t)op.first);
+        W.writeCount(op.second);
+    }
+    size_t externs = 0;
+    W.writeCount(functionProtos.size());
+    for (auto& P : functionProtos) {
+        if (!definedFunctions.count(P.first)) ++externs;
+        P.second->serialize(W);
+        W.writeByte((definedFunctions.count(P.first) ? snapDefined : 0) |
+                    (pureFunctions.count(P.first) ? snapPure : 0));
+    }
+    W.writeCount(liveDefinitions.size());
+    for (auto& D : liveDefinitions) {
+        // a def is linked when it is first called, so its object code is
+        // only there from then on
+        string object;
+        auto symbol = theJIT->findSymbol(D.first);
+        if (!symbol) {
+            logError(toString(symbol.takeError()).c_str());
+            return false;
+        }
+        if (!theJIT->keptObject(D.second.tracker, object)) {
+            logError(("no object code of '" + D.first + "' to save").c_str());
+            return false;
+        }
+        W.writeString(D.first);
+        W.writeByte(D.second.table != NULL);
+        W.writeCount(D.second.callees.size());
+        for (auto& callee : D.second.callees) W.writeString(callee);
+        W.writeString(object);
+    }
+
+    string tmpPath = path + ".tmp" + to_string(getpid());
+    FILE* out = fopen(tmpPath.c_str(), "wb");
+    bool written =
+        out && fwrite(W.getBytes().data(), 1, W.getBytes().size(), out) ==
+                   W.getBytes().size();
+    if (out && fclose(out) != 0) written = false;
+    if (!written || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        logError(("cannot write '" + path + "': " + strerror(errno)).c_str());
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    fprintf(sessionOut, "Saved %zu defs and %zu externs to %s\n",
+            liveDefinitions.size(), externs, path.c_str());
+    return true;
+}
+
+// restoreSnapshot - start the session from a snapshot written by :save
+static bool restoreSnapshot(const char* path) {
+    mappedFile file(path);
+    if (!file.valid()) {
+        logError((string("cannot read snapshot '") + path + "'").c_str());
+        return false;
+    }
+    astReader R(file.begin(), file.end());
+    char magic[sizeof(snapshotMagic)];
+    for (char& c : magic) c = (char)R.readByte();
+    if (memcmp(magic, snapshotMagic, sizeof(magic))) {
+        logError((string("'") + path + "' is not a snapshot").c_str());
+        return false;
+    }
+    ensureBackend();
+    if (R.readString() != snapshotTarget()) {
+        logError((string("'") + path + "' was saved for another target")
+                     .c_str());
+        return false;
+    }
+
+    map<char, int> precedence;
+    for (uint64_t i = 0, n = R.readCount(); i < n && R.ok(); ++i) {
+        char op = (char)R.readByte();
+        precedence[op] = (int)R.readCount();
+    }
+    vector<pair<unique_ptr<prototypeAST>, uint8_t>> protos;
+    for (uint64_t i = 0, n = R.readCount(); i < n && R.ok(); ++i) {
+        auto proto = deserializePrototype(R);
+        if (!proto) break;
+        protos.emplace_back(move(proto), R.readByte());
+    }
+    struct savedDef {
+        string name;
+        bool memo;
+        set<string> callees;
+        string object;
+    };
+    vector<savedDef> defs;
+    for (uint64_t i = 0, n = R.readCount(); i < n && R.ok(); ++i) {
+        savedDef def;
+        def.name = R.readString();
+        def.memo = R.readByte();
+        for (uint64_t j = 0, m = R.readCount(); j < m && R.ok(); ++j)
+            def.callees.insert(R.readString());
+        def.object = R.readString();
+        defs.push_back(move(def));
+    }
+    if (!R.ok() || R.remaining()) {
+        logError((string("snapshot '") + path + "' is damaged").c_str());
+        return false;
+    }
+
+    BinOpPrecedence = move(precedence);
+    for (auto& P : protos) {
+        const string& name = P.first->getName();
+        if (P.second & snapDefined) definedFunctions.insert(name);
+        if (P.second & snapPure) pureFunctions.insert(name);
+        functionProtos[name] = move(P.first);
+    }
+    for (auto& saved : defs) {
+        auto proto = functionProtos.find(saved.name);
+        if (proto == functionProtos.end() ||
+            liveDefinitions.count(saved.name)) {
+            logError(("cannot restore '" + saved.name + "'").c_str());
+            continue;
+        }
+        liveDefinition def;
+        def.callees = move(saved.callees);
+        if (saved.memo) {
+            memoTables.push_back(make_unique<memoTable>(
+                proto->second->getArgTypes().size(), memoCapacity));
+            def.table = memoTables.back().get();
+        }
+        def.tracker = theJIT->addDefinition(
+            MemoryBuffer::getMemBufferCopy(saved.object, saved.name),
+            saved.name, def.table, keepObjects);
+        if (!def.tracker) {
+            logError(("the code of '" + saved.name + "' cannot be loaded")
+                         .c_str());
+            if (def.table) memoTables.pop_back();
+            functionProtos.erase(saved.name);
+            definedFunctions.erase(saved.name);
+            pureFunctions.erase(saved.name);
+            continue;
+        }
+        liveDefinitions[saved.name] = move(def);
+    }
+    fprintf(sessionOut, "Restored %zu defs from %s\n", liveDefinitions.size(),
+            path);
+    return true;
+}
+
+/**
+ * * 映射模式
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * jvavc --map f --input data.bin file.jv: 运行 file.jv 之后,
+ *   * 对输入的每一行计算 f(第 0 列, 第 1 列, ...), 每行一个结果
+ *   * 原始输入按列存放: 每列 rows 个 double 依次排列, 直接 mmap 使用
+ *   * .csv 输入每行一条记录, 读入后转成按列存放
+ *   * 包装函数 __map_f 和内联后的 f 在同一个模块里优化, 循环可以向量化
+ *   * 每次调用处理 mapChunkRows 行, 结果随即写出
+ * !}
+ */
+static const size_t mapChunkRows = 1 << 16;
+static thread_local string mapTarget;     // the function --map applies
+static thread_local string mapTargetAST;  // its latest definition, serialized
+
+static string mapTargetCopy(const functionAST& FnAST) {
+    if (mapTarget.empty() || FnAST.getPrototype().getName() != mapTarget)
+        return string();
+    astWriter W;
+    FnAST.serialize(W);
+    return W.getBytes();
+}
+static void noteMapTarget(const string& name, string copy) {
+    if (name == mapTarget) mapTargetAST = move(copy);
+}
+
+// mapColumns - the input of --map, one contiguous array per column
+struct mapColumns {
+    vector<const double*> columns;
+    size_t rows = 0;
+    unique_ptr<mappedFile> raw;     // raw input, columns point into it
+    vector<vector<double>> parsed;  // CSV input, columns point into it
+};
+
+// readRawColumns - map a file of arity columns of rows doubles each
+static bool readRawColumns(const char* path, size_t arity, mapColumns& input) {
+    if (access(path, R_OK) != 0) {
+        perror(path);
+        return false;
+    }
+    input.raw = make_unique<mappedFile>(path);  // not valid() when empty
+    size_t bytes = input.raw->valid() ? input.raw->contents().size() : 0;
+    if (bytes % (arity * sizeof(double))) {
+        fprintf(stderr, "jvavc: %s does not hold %zu equal columns of doubles\n",
+                path, arity);
+        return false;
+    }
+    input.rows = bytes / (arity * sizeof(double));
+    for (size_t c = 0; c < arity; ++c)
+        input.columns.push_back((const double*)input.raw->begin() +
+                                c * input.rows);
+    return true;
+}
+
+// parseCsvField - a number surrounded by optional blanks
+static bool parseCsvField(const char* begin, const char* end, double& value) {
+    while (begin != end && (*begin == ' ' || *begin == '\t')) ++begin;
+    while (end != begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        --end;
+
+    // plain decimals take the lexer's fast path, the rest go through strtod
+    bool negative = begin != end && *begin == '-';
+    const char* digits = negative ? begin + 1 : begin;
+    if (digits != end && scanNumber(digits, end) == end) {
+        if (!parseNumberLiteral(digits, end, value)) return false;
+        if (negative) value = -value;
+        return true;
+    }
+    char text[64];
+    size_t length = end - begin;
+    if (length == 0 || length >= sizeof(text)) return false;
+    memcpy(text, begin, length);
+    text[length] = '\0';
+    char* stop;
+    value = strtod(text, &stop);
+    return stop == text + length;
+}
+
+// readCsvColumns - one record of arity numbers per line; a first line that
+// does not parse is taken as a header, blank lines are skipped
+static bool readCsvColumns(const char* path, size_t arity, mapColumns& input) {
+    if (access(path, R_OK) != 0) {
+        perror(path);
+        return false;
+    }
+    mappedFile file(path);
+    input.parsed.assign(arity, vector<double>());
+    const char* p = file.valid() ? file.begin() : NULL;
+    const char* end = file.valid() ? file.end() : NULL;
+    vector<double> record(arity);
+    for (unsigned line = 1; p != end; ++line) {
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+
+        bool blank = true;
+        for (const char* q = p; q != eol && blank; ++q)
+            blank = *q == ' ' || *q == '\t' || *q == '\r';
+        size_t fields = 0;
+        bool valid = true;
+        for (const char* field = p; !blank && valid; ++field) {
+            const char* comma = (const char*)memchr(field, ',', eol - field);
+            if (!comma) comma = eol;
+            valid = fields < arity &&
+                    parseCsvField(field, comma, record[fields++]);
+            if (comma == eol) break;
+            field = comma;
+        }
+
+        if (!blank && valid && fields == arity) {
+            for (size_t c = 0; c < arity; ++c)
+                input.parsed[c].push_back(record[c]);
+        } else if (!blank && line > 1) {
+            fprintf(stderr, "jvavc: %s:%u: expected %zu numbers\n", path, line,
+                    arity);
+            return false;
+        }
+        p = eol == end ? end : eol + 1;
+    }
+
+    input.rows = input.parsed.empty() ? 0 : input.parsed[0].size();
+    for (auto& column : input.parsed) input.columns.push_back(column.data());
+    return true;
+}
+
+// emitMapWrapper - void wrapperName(double** columns, double* out, i64 rows)
+// storing f(columns[0][k], columns[1][k], ...) to out[k] for every k, with
+// f compiled into the same module and inlined so the loop can vectorize
+static Function* emitMapWrapper(unique_ptr<functionAST> FnAST,
+                                const string& wrapperName) {
+    Function* F = FnAST->codegen();
+    if (!F) return NULL;
+    // the session already exports f, this copy only exists to be inlined
+    F->setLinkage(GlobalValue::InternalLinkage);
+
+    Type* doubleTy = Type::getDoubleTy(*theContext);
+    Type* i64 = Type::getInt64Ty(*theContext);
+    PointerType* doublePtrTy = PointerType::getUnqual(doubleTy);
+    FunctionType* wrapperTy = FunctionType::get(
+        Type::getVoidTy(*theContext),
+        {PointerType::getUnqual(doublePtrTy), doublePtrTy, i64}, false);
+    Function* wrapper = Function::Create(wrapperTy, Function::ExternalLinkage,
+                                         wrapperName, theModule.get());
+    Argument* columns = wrapper->getArg(0);
+    Argument* out = wrapper->getArg(1);
+    Argument* rows = wrapper->getArg(2);
+    out->addAttr(Attribute::NoAlias);
+
+    BasicBlock* entryBB = BasicBlock::Create(*theContext, "entry", wrapper);
+    BasicBlock* loopBB = BasicBlock::Create(*theContext, "loop", wrapper);
+    BasicBlock* afterBB = BasicBlock::Create(*theContext, "afterloop", wrapper);
+
+    builder->SetInsertPoint(entryBB);
+    vector<Value*> columnPtrs;
+    for (unsigned c = 0; c < F->arg_size(); ++c)
+        columnPtrs.push_back(builder->CreateLoad(
+            doublePtrTy,
+            builder->CreateConstInBoundsGEP1_64(doublePtrTy, columns, c),
+            "column"));
+    builder->CreateCondBr(
+        builder->CreateICmpSGT(rows, ConstantInt::get(i64, 0)), loopBB,
+        afterBB);
+
+    builder->SetInsertPoint(loopBB);
+    PHINode* k = builder->CreatePHI(i64, 2, "k");
+    k->addIncoming(ConstantInt::get(i64, 0), entryBB);
+    vector<Value*> args;
+    for (Value* column : columnPtrs)
+        args.push_back(builder->CreateLoad(
+            doubleTy, builder->CreateInBoundsGEP(doubleTy, column, k), "arg"));
+    CallInst* call = builder->CreateCall(F, args, "result");
+    builder->CreateStore(call, builder->CreateInBoundsGEP(doubleTy, out, k));
+    Value* next =
+        builder->CreateAdd(k, ConstantInt::get(i64, 1), "nextk", true, true);
+    k->addIncoming(next, loopBB);
+    builder->CreateCondBr(builder->CreateICmpSLT(next, rows), loopBB, afterBB);
+
+    builder->SetInsertPoint(afterBB);
+    builder->CreateRetVoid();
+
+    InlineFunctionInfo IFI;
+    InlineFunction(*call, IFI);
+    verifyFunction(*wrapper);
+    theFPM->run(*wrapper);
+    return wrapper;
+}
+
+// runMap - apply the mapped function to every row of inputPath, printing
+// the results one per line or writing them as raw doubles to outputPath
+static int runMap(const char* inputPath, const char* outputPath) {
+    astReader R(mapTargetAST.data(), mapTargetAST.data() + mapTargetAST.size());
+    unique_ptr<functionAST> FnAST;
+    if (!mapTargetAST.empty()) FnAST = deserializeFunction(R);
+    if (!FnAST) {
+        fprintf(stderr, "jvavc: no definition of '%s' to map\n",
+                mapTarget.c_str());
+        return 1;
+    }
+    auto& argTypes = FnAST->getPrototype().getArgTypes();
+    size_t arity = argTypes.size();
+    if (!arity ||
+        (size_t)count(argTypes.begin(), argTypes.end(), tyDouble) != arity ||
+        FnAST->getPrototype().getRetType() != tyDouble) {
+        fprintf(stderr, "jvavc: '%s' must map one or more numbers to a number\n",
+                mapTarget.c_str());
+        return 1;
+    }
+
+    mapColumns input;
+    size_t pathLength = strlen(inputPath);
+    bool csv = pathLength >= 4 && !strcmp(inputPath + pathLength - 4, ".csv");
+    if (!(csv ? readCsvColumns(inputPath, arity, input)
+              : readRawColumns(inputPath, arity, input)))
+        return 1;
+
+    string wrapperName = "__map_" + mapTarget;
+    ensureBackend();
+    if (!emitMapWrapper(move(FnAST), wrapperName)) return 1;
+    auto H =
+        theJIT->addModule(ThreadSafeModule(move(theModule), move(theContext)));
+    initializeModuleAndPassManager();
+    auto wrapperSymbol = theJIT->findSymbol(wrapperName);
+    if (!wrapperSymbol) {
+        logError(toString(wrapperSymbol.takeError()).c_str());
+        return 1;
+    }
+    auto* wrapper = (void (*)(const double* const*, double*, int64_t))(
+        intptr_t)wrapperSymbol->getAddress();
+
+    FILE* out = outputPath ? fopen(outputPath, "wb") : stdout;
+    if (!out) {
+        perror(outputPath);
+        theJIT->removeModule(H);
+        return 1;
+    }
+    vector<double> results(min(input.rows, mapChunkRows));
+    vector<const double*> chunk(input.columns.size());
+    for (size_t begin = 0; begin < input.rows; begin += mapChunkRows) {
+        size_t n = min(mapChunkRows, input.rows - begin);
+        for (size_t c = 0; c < chunk.size(); ++c)
+            chunk[c] = input.columns[c] + begin;
+        wrapper(chunk.data(), results.data(), (int64_t)n);
+        if (outputPath)
+            fwrite(results.data(), sizeof(double), n, out);
+        else
+            for (size_t k = 0; k < n; ++k) fprintf(out, "%.17g\n", results[k]);
+    }
+    theJIT->removeModule(H);
+
+    bool failed = ferror(out);
+    if (outputPath ? fclose(out) != 0 : fflush(out) != 0) failed = true;
+    if (failed) {
+        perror(outputPath ? outputPath : "jvavc: stdout");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * * 监视模式
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * jvavc --watch file.jv: 保持同一个会话, file.jv 每次保存后重新解析,
+ *   * 以语法树的哈希比较每个顶级项, 只重新编译改动过的 def/extern 以及
+ *   * (传递地) 调用它们的 def, 只重新求值新出现的或受影响的顶级表达式
+ *   * 删除的 def 被 forget; 已链接的调用方保存着旧地址, 所以调用方也要重新编译
+ * !}
+ */
+// watchedItem - one top-level item of the watched file, kept serialized so
+// that unchanged stretches of the file are not parsed again
+struct watchedItem {
+    topLevelItem::kindTy kind;
+    string name;             // of a def or extern
+    string bytes;            // the syntax tree, see astWriter
+    uint64_t hash;           // of bytes
+    set<string> references;  // names its code calls or passes to parfor
+};
+
+// watchState - what the session holds of the previous version of the file
+struct watchState {
+    map<string, uint64_t> prototypes;  // live defs and externs, by name
+    set<uint64_t> expressions;         // top-level expressions already run
+    // chunks - the items of each ';' terminated stretch of the file without
+    // syntax errors, by a hash of its text
+    map<uint64_t, shared_ptr<vector<watchedItem>>> chunks;
+};
+
+// parseWatchedChunk - parse one stretch of source, starting on line of the
+// file, into items; false if it has syntax errors
+static bool parseWatchedChunk(StringRef text, unsigned line,
+                              vector<watchedItem>& items) {
+    unsigned savedErrors = errorCount;
+    lexSource(text, line);
+    getNextToken();
+    for (topLevelItem item = parseTopLevelItem();
+         item.kind != topLevelItem::itemEof; item = parseTopLevelItem()) {
+        if (item.kind == topLevelItem::itemForget) {
+            logError("forget is implicit in --watch, delete the def instead");
+            continue;
+        }
+        watchedItem W;
+        W.kind = item.kind;
+        astWriter bytes;
+        if (item.prototype) {
+            W.name = item.prototype->getName();
+            item.prototype->serialize(bytes);
+        } else {
+            if (item.kind == topLevelItem::itemDef)
+                W.name = item.function->getPrototype().getName();
+            item.function->serialize(bytes);
+            forEachNode(item.function->getBody(), [&](exprAST& E) {
+                if (E.getKind() == astCall)
+                    W.references.insert(
+                        static_cast<callExprAST&>(E).getCallee());
+                else if (E.getKind() == astVariable)
+                    W.references.insert(
+                        static_cast<variableExprAST&>(E).getName());
+                return true;
+            });
+        }
+        W.bytes = bytes.getBytes();
+        W.hash = xxHash64(W.bytes);
+        items.push_back(move(W));
+    }
+    resetLexer();
+    return errorCount == savedErrors;
+}
+
+// readWatchedItems - the items of path; only the stretches of it that were
+// not there last time are parsed, the rest come from state.chunks. The items
+// stay owned by the chunks; a stretch with syntax errors gives none, and
+// counts in broken.
+static bool readWatchedItems(const char* path, watchState& state,
+                             unsigned& broken,
+                             vector<const watchedItem*>& items) {
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return false;
+    }
+    string source;
+    char block[1 << 16];
+    for (size_t n; (n = fread(block, 1, sizeof(block), in)) > 0;)
+        source.append(block, n);
+    fclose(in);
+
+    map<uint64_t, shared_ptr<vector<watchedItem>>> chunks;
+    const char* end = source.data() + source.size();
+    unsigned line = 1;  // the line start is on
+    for (const char* start = source.data(); start < end;) {
+        // a chunk ends with a ';' that is not in a comment
+        const char* cur = start;
+        while (cur < end && *cur != ';') {
+            if (*cur == '#')
+                while (cur < end && !(charClasses[(uint8_t)*cur] & ccLineEnd))
+                    ++cur;
+            else
+                ++cur;
+        }
+        if (cur < end) ++cur;
+        StringRef text(start, cur - start);
+        start = cur;
+        unsigned firstLine = line;
+        line += std::count(text.begin(), text.end(), '\n');
+
+        uint64_t textHash = xxHash64(text);
+        auto known = state.chunks.find(textHash);
+        shared_ptr<vector<watchedItem>> chunk;
+        if (known != state.chunks.end()) {
+            chunk = known->second;
+            chunks[textHash] = chunk;
+        } else {
+            chunk = make_shared<vector<watchedItem>>();
+            if (!parseWatchedChunk(text, firstLine, *chunk)) {
+                ++broken;  // not remembered, so its errors are reported again
+                continue;
+            }
+            chunks[textHash] = chunk;
+        }
+        for (auto& W : *chunk) items.push_back(&W);
+    }
+    state.chunks = move(chunks);
+    return true;
+}
+
+// updateWatched - bring the session in line with a new version of the file:
+// forget what changed or went away together with every def calling it, then
+// compile those again and run the expressions that are new or call them.
+// With partial, some stretches had syntax errors: a name missing from items
+// may be in one of them, so it keeps its last good version instead of going.
+static void updateWatched(const vector<const watchedItem*>& items,
+                          bool partial, watchState& state,
+                          chrono::steady_clock::time_point started) {
+    // dirty - names whose code has to be (re)compiled
+    set<string> dirty;
+    map<string, uint64_t> prototypes;
+    map<string, uint64_t> kept;  // names left at their last good version
+    for (auto* W : items) {
+        if (W->kind == topLevelItem::itemExpr) continue;
+        prototypes[W->name] = W->hash;
+        auto old = state.prototypes.find(W->name);
+        if (old == state.prototypes.end() || old->second != W->hash)
+            dirty.insert(W->name);
+    }
+    for (auto& old : state.prototypes)
+        if (!prototypes.count(old.first)) {
+            if (partial)
+                kept.insert(old);
+            else
+                dirty.insert(old.first);
+        }
+    // callers of anything dirty are dirty, they are linked to the old code
+    for (bool grew = true; grew;) {
+        grew = false;
+        for (auto* W : items) {
+            if (W->kind != topLevelItem::itemDef || dirty.count(W->name))
+                continue;
+            for (auto& ref : W->references)
+                if (dirty.count(ref)) {
+                    dirty.insert(W->name);
+                    grew = true;
+                    break;
+                }
+        }
+    }
+
+    // forget the dirty defs together, mutually recursive ones included; one
+    // that something else still calls stays, and so does what it calls
+    unsigned forgotten = 0;
+    set<string> doomed;
+    for (auto& name : dirty)
+        if (liveDefinitions.count(name)) doomed.insert(name);
+    for (bool stuck = true; stuck;) {
+        stuck = false;
+        for (auto it = doomed.begin(); it != doomed.end();)
+            if (const string* caller = liveCaller(*it, doomed)) {
+                logError(("cannot forget '" + *it + "', '" + *caller +
+                          "' calls it")
+                             .c_str());
+                // it stays as it was, and is tried again next time
+                auto old = state.prototypes.find(*it);
+                if (old != state.prototypes.end()) kept.insert(*old);
+                dirty.erase(*it);
+                it = doomed.erase(it);
+                stuck = true;
+            } else {
+                ++it;
+            }
+    }
+    for (auto& name : doomed) {
+        releaseDefinition(name);
+        ++forgotten;
+    }
+    for (auto& name : dirty)
+        if (!prototypes.count(name) && !liveDefinitions.count(name))
+            functionProtos.erase(name);  // a deleted extern
+
+    // then compile and run in source order
+    unsigned compiled = 0, evaluated = 0;
+    set<uint64_t> expressions;
+    for (auto* W : items) {
+        if (W->kind == topLevelItem::itemExpr) {
+            bool affected = !state.expressions.count(W->hash);
+            for (auto& ref : W->references) affected |= dirty.count(ref) > 0;
+            expressions.insert(W->hash);
+            if (!affected) continue;
+            ++evaluated;
+        } else {
+            if (!dirty.count(W->name)) continue;
+            ++compiled;
+        }
+        astReader R(W->bytes.data(), W->bytes.data() + W->bytes.size());
+        topLevelItem item;
+        item.kind = W->kind;
+        if (W->kind == topLevelItem::itemExtern)
+            item.prototype = deserializePrototype(R);
+        else
+            item.function = deserializeFunction(R);
+        emitTopLevelItem(move(item));
+    }
+
+    // a def that failed to compile is tried again next time
+    state.prototypes = move(kept);
+    for (auto& P : prototypes)
+        if (liveDefinitions.count(P.first) ||
+            (functionProtos.count(P.first) && !definedFunctions.count(P.first)))
+            state.prototypes.insert(P);
+    state.expressions = move(expressions);
+    fprintf(sessionOut,
+            "Updated in %.1f ms: %u compiled, %u forgotten, %u evaluated\n",
+            chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                            started)
+                .count(),
+            compiled, forgotten, evaluated);
+    fflush(sessionOut);
+}
+
+// waitForChange - block until the file called name in the directory notify
+// watches is written or replaced, then let a burst of writes settle
+static bool waitForChange(int notify, const string& name) {
+    alignas(inotify_event) char events[4096];
+    for (bool changed = false;;) {
+        pollfd P = {notify, POLLIN, 0};
+        // after a change, 50 ms without another one ends the burst
+        int ready = poll(&P, 1, changed ? 50 : -1);
+        if (ready < 0 && errno != EINTR) return false;
+        if (ready == 0) return true;
+        if (ready < 0) continue;
+        ssize_t length = read(notify, events, sizeof(events));
+        if (length <= 0) return false;
+        for (char* p = events; p < events + length;) {
+            auto* E = (inotify_event*)p;
+            if (E->len && name == E->name) changed = true;
+            p += sizeof(inotify_event) + E->len;
+        }
+    }
+}
+
+// runWatch - the main loop of --watch, until the process is stopped
+static int runWatch(const char* path) {
+    string fullPath(path);
+    size_t slash = fullPath.rfind('/');
+    string dir = slash == string::npos ? "." : fullPath.substr(0, slash);
+    string name = slash == string::npos ? fullPath : fullPath.substr(slash + 1);
+    // the directory, since editors often save by renaming a new file over
+    // the old one
+    int notify = inotify_init1(IN_CLOEXEC);
+    if (notify < 0 ||
+        inotify_add_watch(notify, dir.empty() ? "/" : dir.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        perror("inotify");
+        return 1;
+    }
+
+    watchState state;
+    do {
+        auto started = chrono::steady_clock::now();
+        unsigned broken = 0;
+        vector<const watchedItem*> items;
+        if (readWatchedItems(path, state, broken, items))
+            updateWatched(items, broken > 0, state, started);
+        if (optReport) writeOptReport();  // a watch only ends when killed
+        if (profileListener) reportProfile(stderr);
+    } while (waitForChange(notify, name));
+    close(notify);
+    return 1;
+}
+
+/**
+ * * 编译服务
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * jvavc --serve <socket> 在 Unix domain socket 上监听
+ *   * 每个连接是一个会话: 客户端写入源代码并关闭写端,
+ *   * 服务端把会话的全部输出写回后关闭连接
+ *   * 会话在固定大小的工作线程池上运行, 共享 theEngine
+ * !}
+ */
+static mutex sessionLock;
+static condition_variable sessionReady;
+static deque<int> pendingSessions;  // accepted connections, oldest first
+static atomic<bool> serverStopping{false};
+static atomic<unsigned> sessionsServed{0};
+
+// runSession - compile and run everything a client sends on fd
+static void runSession(int fd, unsigned id) {
+    FILE* in = fdopen(fd, "r");
+    int outFd = dup(fd);
+    FILE* out = outFd < 0 ? NULL : fdopen(outFd, "w");
+    if (!in || !out) {
+        perror("jvavc: session");
+        if (in) fclose(in); else close(fd);
+        if (out) fclose(out); else if (outFd >= 0) close(outFd);
+        return;
+    }
+
+    beginSession(in, out, false, "session" + to_string(id));
+    keepObjects = false;
+    if (restorePath) restoreSnapshot(restorePath);
+    getNextToken();
+    MainLoop();
+    endSession();
+
+    fclose(out);
+    fclose(in);
+}
+
+static void sessionWorker() {
+    while (true) {
+        int fd;
+        {
+            unique_lock<mutex> guard(sessionLock);
+            sessionReady.wait(guard, [] {
+                return serverStopping || !pendingSessions.empty();
+            });
+            if (pendingSessions.empty()) return;
+            fd = pendingSessions.front();
+            pendingSessions.pop_front();
+        }
+        runSession(fd, ++sessionsServed);
+    }
+}
+
+static void stopServer(int) { serverStopping = true; }
+
+// serveSessions - accept clients on socketPath until SIGINT/SIGTERM
+static int serveSessions(const char* socketPath, unsigned workers) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "jvavc: socket path too long: %s\n", socketPath);
+        return 1;
     }
+    strcpy(addr.sun_path, socketPath);
 
-    if (CalleeF->arg_size() != args.size()) {
-        return valueLogError("Incorrect # arguments passed");
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listenFd < 0 || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listenFd, SOMAXCONN) < 0) {
+        perror("jvavc: serve");
+        return 1;
     }
 
-    vector<Value*> argsV;
-    for (unsigned i = 0, e = args.size(); i != e; ++i) {
-        argsV.push_back(args[i]->codegen());
-        if (!argsV.back()) return NULL;
+    // Only the accepting thread handles the stop signals, so that they
+    // interrupt accept() instead of a worker.
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stopServer;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t stopSignals, oldMask;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+    vector<thread> pool;
+    for (unsigned i = 0; i < workers; ++i) pool.emplace_back(sessionWorker);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+    fprintf(stderr, "jvavc: serving on %s with %u workers\n", socketPath,
+            workers);
+    while (!serverStopping) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("jvavc: accept");
+            break;
+        }
+        {
+            lock_guard<mutex> guard(sessionLock);
+            pendingSessions.push_back(fd);
+        }
+        sessionReady.notify_one();
     }
 
-    return builder.CreateCall(CalleeF, argsV, "calltmp");
-}
-Function* prototypeAST::codegen() {
-    // double(double,double)
-    std::vector<Type*> doubles(args.size(), Type::getDoubleTy(theContext));
-    FunctionType* functype =
-        FunctionType::get(Type::getDoubleTy(theContext), doubles, false);
-    Function* func = Function::Create(functype, Function::ExternalLinkage, name,
-                                      theModule.get());
-    // set names for all arguments
-    unsigned idx = 0;
-    for (auto& ARG : func->args()) ARG.setName(args[idx++]);
-    return func;
-}
-Function* functionAST::codegen() {
-    auto& pro = *prototype;
-    functionProtos[prototype->getName()] = move(prototype);
-    // check existing function
-    Function* theFunction = getFunction(pro.getName());
-    if (!theFunction) return NULL;
+    {
+        lock_guard<mutex> guard(sessionLock);
+        serverStopping = true;
+    }
+    sessionReady.notify_all();
+    for (auto& worker : pool) worker.join();
+    close(listenFd);
+    unlink(socketPath);
 
-    // if (!theFunction) theFunction = prototype->codegen();
+    fprintf(stderr,
+            "jvavc: %u sessions served, object cache %llu hits / %llu "
+            "misses\n",
+            sessionsServed.load(),
+            (unsigned long long)theEngine->getCache().getHits(),
+            (unsigned long long)theEngine->getCache().getMisses());
+    return 0;
+}
 
-    // if (!theFunction) return NULL;
+// runLoadGenerator - replay a source file against a compile server from
+// several concurrent clients and report throughput and latency
+static int runLoadGenerator(const char* socketPath, const char* sourcePath,
+                            unsigned clients, unsigned rounds) {
+    FILE* source = fopen(sourcePath, "rb");
+    if (!source) {
+        perror(sourcePath);
+        return 1;
+    }
+    string request;
+    char chunk[4096];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), source)) > 0;)
+        request.append(chunk, n);
+    fclose(source);
 
-    // if (!theFunction->empty()) {
-    //     return (Function*)valueLogError("function connot be redefined");
-    // }
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+    signal(SIGPIPE, SIG_IGN);
 
-    // create a new basic block
-    BasicBlock* bb = BasicBlock::Create(theContext, "entry", theFunction);
-    builder.SetInsertPoint(bb);
+    vector<vector<double>> latencies(clients);
+    atomic<unsigned> failures{0};
+    auto client = [&](unsigned c) {
+        char reply[4096];  // discarded, one per client
+        for (unsigned r = 0; r < rounds; ++r) {
+            auto start = chrono::steady_clock::now();
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+                if (fd >= 0) close(fd);
+                ++failures;
+                continue;
+            }
+            // Send the whole source, then drain the reply. The server
+            // answers while it is still reading, so a large source with a
+            // large reply needs the write in its own thread.
+            thread writer([&request, fd] {
+                size_t sent = 0;
+                while (sent < request.size()) {
+                    ssize_t n = write(fd, request.data() + sent,
+                                      request.size() - sent);
+                    if (n <= 0) break;
+                    sent += n;
+                }
+                shutdown(fd, SHUT_WR);
+            });
+            while (read(fd, reply, sizeof(reply)) > 0) {
+            }
+            writer.join();
+            close(fd);
+            latencies[c].push_back(chrono::duration<double, milli>(
+                                       chrono::steady_clock::now() - start)
+                                       .count());
+        }
+    };
 
-    // record function arguments
-    namedValues.clear();
-    for (auto& ARG : theFunction->args())
-        namedValues[string(ARG.getName())] = &ARG;
+    auto start = chrono::steady_clock::now();
+    vector<thread> pool;
+    for (unsigned c = 0; c < clients; ++c) pool.emplace_back(client, c);
+    for (auto& t : pool) t.join();
+    double seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-    if (Value* returnValue = body->codegen()) {
-        // finish off the function
-        builder.CreateRet(returnValue);
-        verifyFunction(*theFunction);
-        theFPM->run(*theFunction);
-        return theFunction;
+    vector<double> all;
+    for (auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    if (all.empty()) {
+        fprintf(stderr, "jvavc: no request completed (%u failed)\n",
+                failures.load());
+        return 1;
     }
-
-    // error reading body, remove function
-    theFunction->eraseFromParent();
-    return NULL;
+    auto percentile = [&](double p) {
+        return all[min(all.size() - 1, (size_t)(p * all.size()))];
+    };
+    printf("%zu requests from %u clients in %.3f s: %.1f req/s\n", all.size(),
+           clients, seconds, all.size() / seconds);
+    printf("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+           percentile(0.50), percentile(0.90), percentile(0.99), all.back());
+    if (failures) printf("%u requests failed to connect\n", failures.load());
+    return failures ? 1 : 0;
 }
+
 /**
- * * 顶级语法分析
+ * * 执行进程池
  * * Author: Amiriox
  * TODO : NULL
+ * ! remark:{
+ *   * jvavc --executors N: 编译进程只生成目标代码 (仍经过共享的目标文件缓存),
+ *   * 代码在 N 个执行进程 (jvavc --executor) 里链接和运行, 通过管道通信
+ *   * 执行进程为每个会话保留一个 JITDylib, 运行之前先补发这个会话里
+ *   * 它还没有的 def, 所以求值可以交给任意一个空闲的执行进程
+ *   * 执行进程崩溃或超时 (--exec-timeout) 只让这一次求值失败, 随即重启
+ * !}
  */
+// executorOp - the first byte of a message to an executor, followed by the
+// session it is about
+enum executorOp : uint8_t {
+    execDefine = 'D',  // object id, object code, def name, memo, arity: link
+                       // it into the session, with a new table if memo
+    execForget = 'F',  // object id: unlink it and drop its table
+    execEnd = 'E',     // drop the session and everything in it
+    execRun = 'R',     // object code, symbol: link, call, unlink and reply
+};
 
-static void initializeModuleAndPassManager() {
-    // open a new module
-    theModule = std::make_unique<Module>("jvav jit", theContext);
-    theModule->setDataLayout(theJIT->getTargetMachine().createDataLayout());
+// writeFrame/readFrame - one message over a pipe: a 32 bit length, then a
+// body written by an astWriter. readFrame fails at the end of the stream or
+// once deadline, if given, has passed.
+static bool writeFrame(int fd, const string& body) {
+    uint32_t length = body.size();
+    string frame((const char*)&length, sizeof(length));
+    frame += body;
+    for (size_t sent = 0; sent < frame.size();) {
+        ssize_t n = write(fd, frame.data() + sent, frame.size() - sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+static bool readFrame(int fd, string& body,
+                      const chrono::steady_clock::time_point* deadline = NULL) {
+    auto readAll = [&](char* to, size_t size) {
+        while (size) {
+            if (deadline) {
+                auto now = chrono::steady_clock::now();
+                if (now >= *deadline) return false;
+                auto left = chrono::duration_cast<chrono::milliseconds>(
+                                *deadline - now)
+                                .count();
+                pollfd P = {fd, POLLIN, 0};
+                int ready = poll(&P, 1, max(1, (int)left));
+                if (ready < 0 && errno != EINTR) return false;
+                if (ready <= 0) continue;
+            }
+            ssize_t n = read(fd, to, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            to += n;
+            size -= n;
+        }
+        return true;
+    };
+    uint32_t length;
+    if (!readAll((char*)&length, sizeof(length))) return false;
+    body.resize(length);
+    return readAll(&body[0], length);
+}
 
-    // create a new pass manager
-    theFPM = make_unique<legacy::FunctionPassManager>(theModule.get());
+// runExecutor - the main loop of an executor process: messages come in on
+// stdin, the results of runs go out on stdout
+static int runExecutor() {
+    startEngine();
+    map<uint64_t, unique_ptr<jvavJIT>> sessions;
+    // linkedObject - a def linked into a session, with its memo table
+    struct linkedObject {
+        uint64_t session;
+        ResourceTrackerSP tracker;
+        unique_ptr<memoTable> table;
+    };
+    map<uint64_t, linkedObject> objects;  // by id
+    string frame;
+    while (readFrame(0, frame)) {
+        astReader R(frame.data(), frame.data() + frame.size());
+        uint8_t op = R.readByte();
+        uint64_t session = R.readCount();
+        if (op == execEnd) {
+            for (auto it = objects.begin(); it != objects.end();)
+                it = it->second.session == session ? objects.erase(it)
+                                                   : next(it);
+            sessions.erase(session);
+            continue;
+        }
+        if (op == execForget) {
+            auto it = objects.find(R.readCount());
+            if (it == objects.end()) continue;
+            sessions[it->second.session]->removeModule(it->second.tracker);
+            objects.erase(it);
+            continue;
+        }
 
-    theFPM->add(createInstructionCombiningPass());
-    theFPM->add(createReassociatePass());
-    theFPM->add(createGVNPass());
-    theFPM->add(createCFGSimplificationPass());
-    theFPM->doInitialization();
-}
+        auto& jit = sessions[session];
+        if (!jit)
+            jit = make_unique<jvavJIT>(*theEngine,
+                                       "session" + to_string(session));
+        if (op == execDefine) {
+            uint64_t id = R.readCount();
+            string code = R.readString(), name = R.readString();
+            bool memo = R.readByte();
+            unsigned arity = R.readCount();
+            unique_ptr<memoTable> table;
+            if (memo) table = make_unique<memoTable>(arity, memoCapacity);
+            auto RT = jit->addDefinition(MemoryBuffer::getMemBufferCopy(code),
+                                         name, table.get(), false);
+            if (RT) objects[id] = {session, RT, move(table)};
+        } else if (op == execRun) {
+            string code = R.readString(), symbol = R.readString();
+            auto RT = jit->addObject(MemoryBuffer::getMemBufferCopy(code));
+            double result = 0;
+            string error;
+            string output = captureOutput([&] {
+                if (!RT) {
+                    error = "executor: not an object file";
+                    return;
+                }
+                auto exprSymbol = jit->findSymbol(symbol);
+                if (exprSymbol)
+                    result = ((double (*)())(intptr_t)exprSymbol->getAddress())();
+                else
+                    error = toString(exprSymbol.takeError());
+            });
+            if (RT) jit->removeModule(RT);
 
-static void HandleDefinition() {
-    if (auto FnAST = parseDefinition()) {
-        if (auto* FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Read function definition:");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            theJIT->addModule(move(theModule));
-            initializeModuleAndPassManager();
+            astWriter W;
+            W.writeDouble(result);
+            W.writeString(output);
+            W.writeString(error);
+            if (!writeFrame(1, W.getBytes())) return 1;
         }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
     }
+    return 0;
 }
 
-static void HandleExtern() {
-    if (auto ProtoAST = parseExtern()) {
-        if (auto* FnIR = ProtoAST->codegen()) {
-            fprintf(stderr, "Read extern: ");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            functionProtos[ProtoAST->getName()] = move(ProtoAST);
+// executorPool - the executor processes of --executors. Every def a session
+// compiles is kept here as object code; before a run, the executor it goes
+// to is sent whatever of its session it does not have yet, so any idle
+// executor can take it, and a restarted one catches up the same way.
+class executorPool {
+   private:
+    struct executor {
+        pid_t pid = -1;
+        int to = -1, from = -1;  // its stdin and stdout
+        bool busy = false;
+        set<uint64_t> objects;   // the defs it has linked, by object id
+        set<uint64_t> sessions;  // the sessions it holds a dylib for
+    };
+    struct definition {
+        uint64_t session;
+        string code;
+        string name;
+        bool memo;
+        unsigned arity;
+    };
+    mutex lock;
+    condition_variable idle;
+    vector<executor> executors;
+    map<uint64_t, definition> definitions;  // live defs, by object id
+    set<uint64_t> sessions;                 // live sessions
+    string program;                         // this executable
+    vector<string> args;                    // command line of an executor
+    unsigned timeoutMs;
+
+    bool spawn(executor& E) {
+        int down[2], up[2];
+        if (pipe2(down, O_CLOEXEC)) return false;
+        if (pipe2(up, O_CLOEXEC)) {
+            close(down[0]);
+            close(down[1]);
+            return false;
         }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+        vector<char*> argv;
+        for (auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(down[0], 0);
+            dup2(up[1], 1);
+            execv(program.c_str(), argv.data());
+            _exit(127);
+        }
+        close(down[0]);
+        close(up[1]);
+        if (pid < 0) {
+            close(down[1]);
+            close(up[0]);
+            return false;
+        }
+        E.pid = pid;
+        E.to = down[1];
+        E.from = up[0];
+        return true;
+    }
+    // reap - collect an executor that failed, and say what became of it
+    string reap(executor& E, bool timedOut) {
+        kill(E.pid, SIGKILL);
+        close(E.to);
+        close(E.from);
+        int status = 0;
+        waitpid(E.pid, &status, 0);
+        E.pid = -1;
+        E.objects.clear();
+        E.sessions.clear();
+        if (timedOut)
+            return "executor killed after " + to_string(timeoutMs) + " ms";
+        if (WIFSIGNALED(status))
+            return string("executor crashed: ") + strsignal(WTERMSIG(status));
+        return "executor exited with status " +
+               to_string(WEXITSTATUS(status));
     }
-}
 
-static void HandleTopLevelExpression() {
-    // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = parseTopLevelExpr()) {
-        if (auto* FnIR = FnAST->codegen()) {
-            //JIT
-            auto H = theJIT->addModule(move(theModule));
-            initializeModuleAndPassManager();
+    // catchUp - the frames that bring E in line with session: drop what
+    // has gone, link what it has not seen. Called with lock held.
+    vector<string> catchUp(executor& E, uint64_t session) {
+        vector<string> frames;
+        for (auto it = E.sessions.begin(); it != E.sessions.end();) {
+            if (sessions.count(*it)) {
+                ++it;
+                continue;
+            }
+            astWriter W;
+            W.writeByte(execEnd);
+            W.writeCount(*it);
+            frames.push_back(W.getBytes());
+            it = E.sessions.erase(it);
+        }
+        for (auto it = E.objects.begin(); it != E.objects.end();) {
+            if (definitions.count(*it)) {
+                ++it;
+                continue;
+            }
+            astWriter W;
+            W.writeByte(execForget);
+            W.writeCount(session);
+            W.writeCount(*it);
+            frames.push_back(W.getBytes());
+            it = E.objects.erase(it);
+        }
+        for (auto& D : definitions) {
+            if (D.second.session != session || E.objects.count(D.first))
+                continue;
+            astWriter W;
+            W.writeByte(execDefine);
+            W.writeCount(session);
+            W.writeCount(D.first);
+            W.writeString(D.second.code);
+            W.writeString(D.second.name);
+            W.writeByte(D.second.memo);
+            W.writeCount(D.second.arity);
+            frames.push_back(W.getBytes());
+            E.objects.insert(D.first);
+        }
+        E.sessions.insert(session);
+        return frames;
+    }
+
+   public:
+    executorPool(unsigned count, unsigned timeout, vector<string> argv)
+        : executors(count), args(move(argv)), timeoutMs(timeout) {
+        char path[4096];
+        ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        program = length > 0 ? string(path, length) : "/proc/self/exe";
+        // a write to a dead executor fails with EPIPE instead of killing us
+        signal(SIGPIPE, SIG_IGN);
+        for (auto& E : executors) spawn(E);
+    }
+    ~executorPool() {
+        for (auto& E : executors) {
+            if (E.pid < 0) continue;
+            close(E.to);  // the end of its input stops it
+            close(E.from);
+            waitpid(E.pid, NULL, 0);
+        }
+    }
 
-            auto exprSymbol = theJIT->findSymbol("__anon_expr");
-            assert(exprSymbol && "Function not found");
+    void define(uint64_t session, uint64_t object, const string& name,
+                bool memo, unsigned arity, string code) {
+        lock_guard<mutex> guard(lock);
+        sessions.insert(session);
+        definitions[object] = {session, move(code), name, memo, arity};
+    }
+    void forget(uint64_t object) {
+        lock_guard<mutex> guard(lock);
+        definitions.erase(object);
+    }
+    void endSession(uint64_t session) {
+        lock_guard<mutex> guard(lock);
+        sessions.erase(session);
+        for (auto it = definitions.begin(); it != definitions.end();)
+            it = it->second.session == session ? definitions.erase(it)
+                                               : next(it);
+    }
 
-            double (*FP)() = (double (*)())(intptr_t)cantFail(exprSymbol.getAddress());
-            fprintf(stderr, "Evaluated to %f\n", FP());
+    // run - call symbol of code in the session on an idle executor
+    bool run(uint64_t session, string code, const string& symbol,
+             double& result, string& output, string& error) {
+        unique_lock<mutex> guard(lock);
+        executor* E = NULL;
+        idle.wait(guard, [&] {
+            for (auto& candidate : executors)
+                if (!candidate.busy) {
+                    E = &candidate;
+                    return true;
+                }
+            return false;
+        });
+        E->busy = true;
+        astWriter W;
+        W.writeByte(execRun);
+        W.writeCount(session);
+        W.writeString(code);
+        W.writeString(symbol);
 
-            theJIT->removeModule(H);
+        // an executor that died while idle is only found out by writing to
+        // it; none of the run has happened then, so a fresh one gets it all
+        bool ok;
+        for (bool retried = false;; retried = true) {
+            if (E->pid < 0) spawn(*E);
+            vector<string> frames = catchUp(*E, session);
+            frames.push_back(W.getBytes());
+            guard.unlock();
+            ok = E->pid >= 0;
+            for (auto& frame : frames) ok = ok && writeFrame(E->to, frame);
+            if (ok || E->pid < 0 || retried) break;
+            reap(*E, false);
+            guard.lock();
         }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+        auto deadline =
+            chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+        string reply;
+        ok = ok && readFrame(E->from, reply, timeoutMs ? &deadline : NULL);
+        if (ok) {
+            astReader R(reply.data(), reply.data() + reply.size());
+            result = R.readDouble();
+            output = R.readString();
+            error = R.readString();
+            if (!R.ok()) error = "executor: malformed reply";
+        } else if (E->pid < 0) {
+            error = "cannot start an executor";
+        } else {
+            error = reap(*E, timeoutMs &&
+                                 chrono::steady_clock::now() >= deadline);
+            spawn(*E);  // a fresh one for the next run
+        }
+
+        guard.lock();
+        E->busy = false;
+        idle.notify_one();
+        return error.empty();
     }
+};
+
+static unique_ptr<executorPool> theExecutors;
+
+static void remoteDefine(uint64_t object, const string& name, bool memo,
+                         unsigned arity, string bytes) {
+    theExecutors->define(sessionId, object, name, memo, arity, move(bytes));
 }
+static void remoteForget(uint64_t object) { theExecutors->forget(object); }
+static bool remoteRun(string bytes, const string& symbol, double& result,
+                      string& output, string& error) {
+    return theExecutors->run(sessionId, move(bytes), symbol, result, output,
+                             error);
+}
+static void remoteEndSession() { theExecutors->endSession(sessionId); }
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
-    while (true) {
-        fprintf(stderr, "ready> ");
-        switch (curTok) {
-            case tokEof:
-                return;
-            case ';':  // ignore top-level semicolons.
-                getNextToken();
-                break;
-            case tokDef:
-                HandleDefinition();
+/**
+ * * 内存统计
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * jvavc --mem-report: 会话结束时打印语法树, IR, 符号表, 备忘表,
+ *   * JIT 代码/数据段以及目标文件缓存各占多少内存
+ *   * JIT 段和目标文件缓存是进程级别的, 由所有会话共享
+ * !}
+ */
+// formatBytes - a byte count for people
+static string formatBytes(size_t bytes) {
+    char text[32];
+    if (bytes < 1024)
+        snprintf(text, sizeof(text), "%zu B", bytes);
+    else if (bytes < (1 << 20))
+        snprintf(text, sizeof(text), "%.1f KiB", bytes / 1024.0);
+    else
+        snprintf(text, sizeof(text), "%.1f MiB", bytes / 1048576.0);
+    return text;
+}
+
+// residentBytes - resident set size of the process, 0 without /proc
+static size_t residentBytes() {
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) return 0;
+    unsigned long pages, resident;
+    if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// printMemoryReport - where the memory of the session goes, see --mem-report
+static void printMemoryReport() {
+    size_t astBytes = 0, externs = 0;
+    for (auto& P : functionProtos) {
+        astBytes += P.second->footprint();
+        if (!definedFunctions.count(P.first)) ++externs;
+    }
+    size_t functions = 0, instructions = 0;
+    if (theModule)
+        for (auto& F : *theModule) {
+            ++functions;
+            instructions += F.getInstructionCount();
+        }
+    size_t memoBytes = 0;
+    for (auto& table : memoTables) memoBytes += table->bytes();
+
+    fprintf(sessionOut, "memory report:\n");
+    fprintf(sessionOut, "  syntax trees  %zu prototypes, %s; --map copy %s\n",
+            functionProtos.size(), formatBytes(astBytes).c_str(),
+            formatBytes(mapTargetAST.size()).c_str());
+    fprintf(sessionOut,
+            "  ir            open module %zu functions, %zu instructions; "
+            "compiled modules are freed with their contexts\n",
+            functions, instructions);
+    fprintf(sessionOut, "  symbols       %zu defs, %zu externs, %zu builtins\n",
+            liveDefinitions.size(), externs, array_lengthof(runtimeBuiltins));
+    fprintf(sessionOut, "  memo tables   %zu, %s\n", memoTables.size(),
+            formatBytes(memoBytes).c_str());
+    if (!theEngine) {
+        fprintf(sessionOut, "  jit           never started\n");
+        fprintf(sessionOut, "  resident      %s\n",
+                formatBytes(residentBytes()).c_str());
+        return;
+    }
+    auto& jit = theEngine->getMemory().stats;
+    auto& cache = theEngine->getCache();
+    fprintf(sessionOut,
+            "  jit code      %zu objects, %s of code and constants in %s of "
+            "pages\n",
+            jit.objects.load(), formatBytes(jit.spanUsed).c_str(),
+            formatBytes(jit.spanBytes).c_str());
+    fprintf(sessionOut, "  jit data      %s in %s of slabs\n",
+            formatBytes(jit.slabUsed).c_str(),
+            formatBytes(jit.slabBytes).c_str());
+    fprintf(sessionOut, "  object cache  %zu objects, %s (limit %s)\n",
+            cache.getEntries(), formatBytes(cache.getBytes()).c_str(),
+            formatBytes(objectCacheLimit).c_str());
+    size_t kept;
+    size_t keptBytes = theEngine->keptBytes(kept);
+    fprintf(sessionOut, "  kept objects  %zu defs, %s, for :save\n", kept,
+            formatBytes(keptBytes).c_str());
+    fprintf(sessionOut, "  resident      %s\n",
+            formatBytes(residentBytes()).c_str());
+}
+
+/**
+ * * 优化报告
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * jvavc --opt-report <file>: 每个 def 和表达式一行 JSON, 包括优化前后的
+ *   * IR 指令数, 改变了指令数的每个 pass, 优化器和代码生成器给出的 remark
+ *   * (向量化, 展开, GVN, 栈大小等), 以及 LLVM 统计数的变化 (LLVM 要以
+ *   * LLVM_ENABLE_STATS 构建才有)
+ *   * 统计数是进程级别的, 多个会话同时编译时会互相计入
+ * !}
+ */
+// optRemark - one optimization remark about a function
+struct optRemark {
+    const Function* function;  // only compared, it may be gone by now
+    const char* kind;
+    string pass, name, message;
+};
+// optFunction - a function as theFPM left it
+struct optFunction {
+    const Function* function;
+    string name;
+    unsigned before, after;  // IR instructions
+    vector<functionOptimizer::passChange> passes;  // the ones that changed it
+    vector<pair<string, unsigned>> statistics;     // the ones that changed
+};
+// optRecord - the report on one module. Remarks keep coming in when the JIT
+// compiles the module to machine code, possibly on another thread.
+struct optRecord {
+    mutex lock;
+    vector<optFunction> functions;
+    vector<optRemark> remarks;
+};
+static thread_local vector<shared_ptr<optRecord>> optRecords;  // unwritten
+static mutex optReportLock;  // sessions share the file
+
+// optRemarkCollector - diagnostic handler of a context under --opt-report,
+// which asks for every remark and keeps them in the module's record
+class optRemarkCollector : public DiagnosticHandler {
+   private:
+    shared_ptr<optRecord> record;
+
+   public:
+    explicit optRemarkCollector(shared_ptr<optRecord> R) : record(move(R)) {}
+    optRecord& getRecord() const { return *record; }
+
+    bool isAnalysisRemarkEnabled(StringRef) const override { return true; }
+    bool isMissedOptRemarkEnabled(StringRef) const override { return true; }
+    bool isPassedOptRemarkEnabled(StringRef) const override { return true; }
+    bool isAnyRemarkEnabled() const override { return true; }
+    bool handleDiagnostics(const DiagnosticInfo& DI) override {
+        auto* remark = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+        if (!remark) return false;  // errors and warnings as usual
+        const char* kind;
+        switch (DI.getKind()) {
+            case DK_OptimizationRemark:
+            case DK_MachineOptimizationRemark:
+                kind = "passed";
                 break;
-            case tokExtern:
-                HandleExtern();
+            case DK_OptimizationRemarkMissed:
+            case DK_MachineOptimizationRemarkMissed:
+                kind = "missed";
                 break;
             default:
-                HandleTopLevelExpression();
-                break;
+                kind = "analysis";
+        }
+        lock_guard<mutex> guard(record->lock);
+        record->remarks.push_back({&remark->getFunction(), kind,
+                                   remark->getPassName().str(),
+                                   remark->getRemarkName().str(),
+                                   remark->getMsg()});
+        return true;
+    }
+};
+
+// watchRemarks - give a new context its record
+static void watchRemarks(LLVMContext& context) {
+    optRecords.push_back(make_shared<optRecord>());
+    context.setDiagnosticHandler(
+        make_unique<optRemarkCollector>(optRecords.back()));
+}
+
+// optimizeReported - theFPM->run, noting what it did in the record of F
+static void optimizeReported(Function& F) {
+    optFunction entry;
+    entry.function = &F;
+    entry.name = F.getName().str();
+    entry.before = F.getInstructionCount();
+    map<string, unsigned> earlier;
+    for (auto& S : GetStatistics()) earlier[S.first.str()] = S.second;
+    theFPM->run(F);
+    entry.after = F.getInstructionCount();
+    entry.passes = theFPM->takeChanges();
+    for (auto& S : GetStatistics())
+        if (S.second != earlier[S.first.str()])
+            entry.statistics.emplace_back(S.first.str(),
+                                          S.second - earlier[S.first.str()]);
+
+    auto* collector =
+        static_cast<const optRemarkCollector*>(F.getContext().getDiagHandlerPtr());
+    optRecord& record = collector->getRecord();
+    lock_guard<mutex> guard(record.lock);
+    record.functions.push_back(move(entry));
+}
+
+// writeOptReport - a line for every function optimized since the last call.
+// The remarks of the code generator are in it if the JIT has compiled the
+// function by then.
+static void writeOptReport() {
+    string lines;
+    raw_string_ostream out(lines);
+    for (auto& record : optRecords) {
+        lock_guard<mutex> guard(record->lock);
+        for (auto& F : record->functions) {
+            json::OStream J(out);
+            J.object([&] {
+                J.attribute("session", sessionName);
+                J.attribute("function", F.name);
+                J.attributeObject("instructions", [&] {
+                    J.attribute("before", (int64_t)F.before);
+                    J.attribute("after", (int64_t)F.after);
+                });
+                J.attributeArray("passes", [&] {
+                    for (auto& P : F.passes)
+                        J.object([&] {
+                            J.attribute("pass", P.pass);
+                            J.attribute("before", (int64_t)P.before);
+                            J.attribute("after", (int64_t)P.after);
+                        });
+                });
+                if (!F.statistics.empty())
+                    J.attributeObject("statistics", [&] {
+                        for (auto& S : F.statistics)
+                            J.attribute(S.first, (int64_t)S.second);
+                    });
+                J.attributeArray("remarks", [&] {
+                    for (auto& R : record->remarks) {
+                        if (R.function != F.function) continue;
+                        J.object([&] {
+                            J.attribute("kind", R.kind);
+                            J.attribute("pass", R.pass);
+                            J.attribute("name", R.name);
+                            J.attribute("message", R.message);
+                        });
+                    }
+                });
+            });
+            out << "\n";
         }
     }
+    optRecords.clear();
+
+    lock_guard<mutex> guard(optReportLock);
+    *optReport << out.str();
+    optReport->flush();
 }
+
 /**
- * * 库函数
+ * * 采样分析
  * * Author: Amiriox
  * TODO : NULL
+ * ! remark:{
+ *   * jvavc --profile: 每 1 ms CPU 时间 (SIGPROF, 实际间隔取决于内核的时钟
+ *   * 频率) 记下指令指针, 栈顶和帧指针链,
+ *   * 退出时 (--watch 是每一轮之后) 按 def 打印平坦剖析和调用图
+ *   * 生成的代码保留帧指针; 读栈用 process_vm_readv, 坏指针只会读失败
+ *   * 地址按 JIT 载入的目标文件的符号表解析, 代码释放之前先解析已有的样本
+ * !}
  */
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
+// profileSample - one tick: where the thread was, the top of its stack up to
+// the frame pointer (a function outside the generated code need not keep
+// one, but the return address into its caller is in there) and the return
+// addresses along the frame pointer chain
+struct profileSample {
+    static const unsigned maxWords = 64, maxReturns = 32;
+    atomic<bool> ready{false};
+    uint64_t ip;
+    uint64_t words[maxWords];
+    uint64_t returns[maxReturns];
+    unsigned wordCount, depth;
+};
+
+// readOwnMemory - copy size bytes at address; false rather than a crash if
+// they are not mapped, and safe in a signal handler
+static bool readOwnMemory(uint64_t address, void* to, size_t size) {
+    iovec local = {to, size}, remote = {(void*)address, size};
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) ==
+           (ssize_t)size;
+}
+
+// samplingProfiler - the profiler of --profile, for the whole process. The
+// signal handler only writes samples into a ring; drain resolves them to
+// defs, on a thread of its own and before the JIT frees any code, so no
+// address is looked up after its code is gone.
+class samplingProfiler : public JITEventListener {
+   private:
+    static const size_t slots = 1 << 12;
+    profileSample ring[slots];
+    atomic<uint64_t> claimed{0}, drained{0}, dropped{0};
+
+    mutex lock;  // guards everything below
+    map<uint64_t, pair<uint64_t, string>> code;  // start: end, name
+    map<ObjectKey, vector<uint64_t>> objects;    // the starts in each object
+    uint64_t samples = 0, outside = 0;
+    timespec since;  // CPU time of the process when the samples began
+    // self: in the def's own code; host: in a library or runtime function it
+    // called; total: anywhere below it
+    map<string, uint64_t> self, host, total;
+    map<pair<string, string>, uint64_t> calls;  // caller, callee
+    thread drainer;
+    condition_variable wake;
+    bool stopping = false;
+
+    const string* nameAt(uint64_t address) {
+        auto it = code.upper_bound(address);
+        if (it == code.begin()) return NULL;
+        --it;
+        return address < it->second.first ? &it->second.second : NULL;
+    }
+    void resolve(const profileSample& S) {
+        ++samples;
+        vector<const string*> stack;  // the defs, innermost first
+        const string* leaf = nameAt(S.ip);
+        uint64_t scanned = 0;
+        if (leaf)
+            stack.push_back(leaf);
+        else  // the return address nearest the caller's frame
+            for (unsigned i = S.wordCount; i-- > 0;) {
+                const string* name = nameAt(S.words[i]);
+                if (name && followsCall(S.words[i])) {
+                    stack.push_back(name);
+                    scanned = S.words[i];
+                    break;
+                }
+            }
+        for (unsigned i = 0; i < S.depth; ++i) {
+            if (i == 0 && S.returns[0] == scanned) continue;  // seen already
+            if (const string* name = nameAt(S.returns[i]))
+                stack.push_back(name);
+            else if (!stack.empty())
+                break;  // out of the generated code again
+        }
+        if (stack.empty()) {
+            ++outside;
+            return;
+        }
+
+        ++(leaf ? self : host)[*stack[0]];
+        auto seenBelow = [&](size_t i, const string& name) {
+            for (size_t j = 0; j < i; ++j)
+                if (*stack[j] == name) return true;
+            return false;
+        };
+        for (size_t i = 0; i < stack.size(); ++i)
+            if (!seenBelow(i, *stack[i])) ++total[*stack[i]];
+        set<pair<string, string>> edges;  // a recursion counts once
+        for (size_t i = 0; i + 1 < stack.size(); ++i)
+            edges.insert({*stack[i + 1], *stack[i]});
+        for (auto& E : edges) ++calls[E];
+    }
+    // followsCall - whether the generated code at address comes right after
+    // a call, as a return address does (and a stray pointer mostly does not);
+    // the bytes before it are read with readOwnMemory, since a stray pointer
+    // may be at the start of a mapping
+    static bool followsCall(uint64_t address) {
+#if defined(__x86_64__)
+        uint8_t before[7];  // before[7 - k] is the byte k before address
+        if (!readOwnMemory(address - sizeof(before), before, sizeof(before)))
+            return false;
+        const uint8_t* code = before + sizeof(before);
+        if (code[-5] == 0xE8) return true;  // call rel32
+        for (int length : {2, 3, 4, 6, 7})  // call r/m64
+            if (code[-length] == 0xFF && ((code[1 - length] >> 3) & 7) == 2)
+                return true;
+        return false;
+#elif defined(__aarch64__)
+        uint32_t insn;
+        if (!readOwnMemory(address - 4, &insn, 4)) return false;
+        return (insn & 0xFC000000) == 0x94000000 ||  // bl
+               (insn & 0xFFFFFC1F) == 0xD63F0000;    // blr
 #else
-#define DLLEXPORT
+        return true;
 #endif
+    }
+    void drainLocked() {
+        uint64_t end = claimed.load(memory_order_acquire);
+        for (uint64_t n = drained.load(memory_order_relaxed); n != end; ++n) {
+            profileSample& S = ring[n % slots];
+            // a handler may still be writing it, on another thread
+            while (!S.ready.load(memory_order_acquire)) this_thread::yield();
+            resolve(S);
+            S.ready.store(false, memory_order_relaxed);
+            drained.store(n + 1, memory_order_release);
+        }
+    }
+    static string displayName(const string& name) {
+        return StringRef(name).startswith("__anon_expr") ? "(top level)"
+                                                         : name;
+    }
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
-  return 0;
+   public:
+    ~samplingProfiler() { stop(); }
+
+    // record - called by the signal handler with the interrupted registers
+    void record(uint64_t ip, uint64_t sp, uint64_t fp) {
+        uint64_t n = claimed.load(memory_order_relaxed);
+        do {
+            if (n - drained.load(memory_order_acquire) >= slots) {
+                ++dropped;
+                return;
+            }
+        } while (!claimed.compare_exchange_weak(n, n + 1));
+        profileSample& S = ring[n % slots];
+        S.ip = ip;
+        S.wordCount = fp > sp && fp - sp < sizeof(S.words) ? (fp - sp) / 8
+                                                            : S.maxWords;
+        if (!readOwnMemory(sp, S.words, S.wordCount * 8)) S.wordCount = 0;
+        S.depth = 0;
+        while (S.depth < S.maxReturns && fp >= sp && !(fp & 7)) {
+            uint64_t frame[2];  // the caller's frame pointer, return address
+            if (!readOwnMemory(fp, frame, sizeof(frame))) break;
+            S.returns[S.depth++] = frame[1];
+            if (frame[0] <= fp) break;  // callers are further up the stack
+            fp = frame[0];
+        }
+        S.ready.store(true, memory_order_release);
+    }
+
+    void notifyObjectLoaded(ObjectKey K, const object::ObjectFile& obj,
+                            const RuntimeDyld::LoadedObjectInfo& L) override {
+        // the symbols of the copy are at their load addresses
+        auto loaded = L.getObjectForDebug(obj);
+        if (!loaded.getBinary()) return;
+        lock_guard<mutex> guard(lock);
+        for (auto& P : object::computeSymbolSizes(*loaded.getBinary())) {
+            auto type = P.first.getType();
+            auto name = P.first.getName();
+            auto address = P.first.getAddress();
+            if (!type || !name || !address) {
+                consumeError(type.takeError());
+                consumeError(name.takeError());
+                consumeError(address.takeError());
+                continue;
+            }
+            if (*type != object::SymbolRef::ST_Function || !P.second) continue;
+            code[*address] = {*address + P.second, name->str()};
+            objects[K].push_back(*address);
+        }
+    }
+    void notifyFreeingObject(ObjectKey K) override {
+        lock_guard<mutex> guard(lock);
+        drainLocked();
+        for (uint64_t start : objects[K]) code.erase(start);
+        objects.erase(K);
+    }
+
+    bool start();
+    void stop() {
+        itimerval off = {};
+        setitimer(ITIMER_PROF, &off, NULL);
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (drainer.joinable()) drainer.join();
+    }
+
+    // report - print the profile so far to out, and start over
+    void report(FILE* out) {
+        lock_guard<mutex> guard(lock);
+        drainLocked();
+        timespec now;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+        double cpuMs = (now.tv_sec - since.tv_sec) * 1e3 +
+                       (now.tv_nsec - since.tv_nsec) / 1e6;
+        since = now;
+        fprintf(out, "profile: %llu samples in %.0f ms of CPU time, %llu in "
+                     "generated code or what it called",
+                (unsigned long long)samples, cpuMs,
+                (unsigned long long)(samples - outside));
+        if (uint64_t lost = dropped.exchange(0))
+            fprintf(out, ", %llu lost", (unsigned long long)lost);
+        fprintf(out, "\n");
+        if (samples != outside) {
+            auto percent = [&](uint64_t n) { return 100.0 * n / samples; };
+            vector<string> byTotal;
+            for (auto& T : total) byTotal.push_back(T.first);
+            std::sort(byTotal.begin(), byTotal.end(),
+                      [&](const string& a, const string& b) {
+                          return total[a] > total[b];
+                      });
+            vector<string> bySelf = byTotal;
+            std::stable_sort(bySelf.begin(), bySelf.end(),
+                        [&](const string& a, const string& b) {
+                            return self[a] + host[a] > self[b] + host[b];
+                        });
+
+            fprintf(out, "    self    host   total  def\n");
+            for (auto& name : bySelf)
+                fprintf(out, "  %5.1f%%  %5.1f%%  %5.1f%%  %s\n",
+                        percent(self[name]), percent(host[name]),
+                        percent(total[name]), displayName(name).c_str());
+            fprintf(out, "call graph:\n");
+            for (auto& name : byTotal) {
+                fprintf(out, "  %5.1f%%  %s\n", percent(total[name]),
+                        displayName(name).c_str());
+                for (auto& C : calls)
+                    if (C.first.second == name)
+                        fprintf(out, "            called by %s  %.1f%%\n",
+                                displayName(C.first.first).c_str(),
+                                percent(C.second));
+                for (auto& C : calls)
+                    if (C.first.first == name)
+                        fprintf(out, "            calls %s  %.1f%%\n",
+                                displayName(C.first.second).c_str(),
+                                percent(C.second));
+            }
+        }
+        samples = outside = 0;
+        self.clear();
+        host.clear();
+        total.clear();
+        calls.clear();
+    }
+};
+
+static unique_ptr<samplingProfiler> theProfiler;
+static void reportProfile(FILE* out) { theProfiler->report(out); }
+
+static void profileSignal(int, siginfo_t*, void* context) {
+    int savedErrno = errno;
+    auto& regs = static_cast<ucontext_t*>(context)->uc_mcontext;
+#if defined(__x86_64__)
+    theProfiler->record(regs.gregs[REG_RIP], regs.gregs[REG_RSP],
+                        regs.gregs[REG_RBP]);
+#elif defined(__aarch64__)
+    theProfiler->record(regs.pc, regs.sp, regs.regs[29]);
+#endif
+    errno = savedErrno;
 }
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
-  return 0;
+// start - install the handler and the timer, false where the registers of
+// an interrupted thread cannot be read
+bool samplingProfiler::start() {
+#if !defined(__x86_64__) && !defined(__aarch64__)
+    return false;
+#else
+    struct sigaction action = {};
+    action.sa_sigaction = profileSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL)) return false;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &since);
+    drainer = thread([this] {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_for(guard, chrono::milliseconds(50));
+            drainLocked();
+        }
+    });
+    itimerval every = {{0, 1000}, {0, 1000}};
+    return !setitimer(ITIMER_PROF, &every, NULL);
+#endif
+}
+
+/**
+ * * 编译开销
+ * * Author: Amiriox
+ * TODO : NULL
+ * ! remark:{
+ *   * jvavc --bench-compile N: 每个顶级项目的固定开销, 即短小的 def 和
+ *   * 表达式花在建模块, 优化和交给 JIT 上的时间
+ * !}
+ */
+// runCompileBench - compile N one-line defs, then N expressions calling
+// them, and print the time per item. The items all differ, so the object
+// cache never answers for them, and the expressions include the machine
+// code of the defs, which the JIT compiles on their first call.
+static int runCompileBench(unsigned count) {
+    string defs, calls;
+    for (unsigned i = 0; i < count; ++i) {
+        defs += "def bench" + to_string(i) + "(x) x * " + to_string(i) +
+                " + 1;\n";
+        calls += "bench" + to_string(i) + "(" + to_string(i) + ");\n";
+    }
+    FILE* discard = fopen("/dev/null", "w");
+    if (!discard) {
+        perror("/dev/null");
+        return 1;
+    }
+    beginSession(stdin, discard, false, "bench");
+    ensureBackend();  // starting LLVM is paid once, not per item
+
+    auto microsEach = [&](const string& text) {
+        auto start = chrono::steady_clock::now();
+        lexSource(text);
+        getNextToken();
+        for (topLevelItem item = parseTopLevelItem();
+             item.kind != topLevelItem::itemEof; item = parseTopLevelItem())
+            emitTopLevelItem(move(item));
+        return chrono::duration<double, micro>(chrono::steady_clock::now() -
+                                               start)
+                   .count() /
+               count;
+    };
+    double defCost = microsEach(defs);
+    double callCost = microsEach(calls);
+    unsigned errors = errorCount;
+    endSession();
+    fclose(discard);
+
+    printf("%u defs: %.1f us each\n", count, defCost);
+    printf("%u expressions calling them: %.1f us each\n", count, callCost);
+    return errors ? 1 : 0;
 }
 
 /**
@@ -643,27 +6462,278 @@ extern "C" DLLEXPORT double printd(double X) {
  * * Author: Amiriox
  * TODO : NULL
  */
-int main() {
-    InitializeNativeTarget();
-    InitializeNativeTargetAsmPrinter();
-    InitializeNativeTargetAsmParser();
+static void printUsage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s                      read-eval-print loop on stdin\n"
+            "       %s [--pipeline|--concurrent] <file.jv>   run a source "
+            "file\n"
+            "       %s --watch <file.jv>   run it again, incrementally, on "
+            "every save\n"
+            "       %s --serve <socket> [--workers N]\n"
+            "       %s --load <socket> <file.jv> [--clients N] [--rounds N]\n"
+            "options:\n"
+            "  --prelude <file.jv>   run file.jv first, through the AST cache\n"
+            "  --restore <file>      start every session from a snapshot "
+            "written by :save\n"
+            "  --savable             keep the object code of every def, so "
+            ":save can write it\n"
+            "  --ast-cache <dir>     AST cache directory (~/.cache/jvavc)\n"
+            "  --fast-math           let the optimizer reassociate floating "
+            "point math\n"
+            "  --map <f>             after the program, print f of every "
+            "input row\n"
+            "  --input <file>        --map input: columns of raw doubles, or "
+            "CSV\n"
+            "  --output <file>       --map results as raw doubles instead of "
+            "text\n"
+            "  --memo-capacity <N>   slots in the result table of a memo def "
+            "(65536)\n"
+            "  --memo-evict <policy> when a memo table is full: lru, none or "
+            "grow\n"
+            "  --threads <N>         threads for parfor, parsum and "
+            "--concurrent (one per core)\n"
+            "  --object-cache-size <MiB>  compiled objects kept for reuse "
+            "(64)\n"
+            "  --mem-report          print where the memory went at the end "
+            "of a session\n"
+            "  --executors <N>       run the generated code in N separate "
+            "processes\n"
+            "  --exec-timeout <ms>   kill an executor that runs longer (0: "
+            "never)\n"
+            "  --bench-compile <N>   time N short defs and N calls, per item, "
+            "and exit\n"
+            "  --opt-report <file>   a JSON line per def and expression: "
+            "passes, remarks, sizes\n"
+            "  --profile             sample the generated code, print a "
+            "profile per def at exit\n",
+            argv0, argv0, argv0, argv0, argv0);
+}
 
+int main(int argc, char** argv) {
+    const char* servePath = NULL;
+    const char* loadPath = NULL;
+    const char* loadSource = NULL;
+    unsigned workers = max(1u, thread::hardware_concurrency());
+    unsigned clients = 8, rounds = 100;
+    const char* sourcePath = NULL;
+    bool pipelined = false;
+    bool concurrent = false;
+    bool watch = false;
+    vector<const char*> preludes;
+    string astCacheDir = defaultAstCacheDir();
+    const char* mapFunction = NULL;
+    const char* mapInput = NULL;
+    const char* mapOutput = NULL;
+    unsigned executors = 0, execTimeout = 0;
+    bool executorMode = false;
+    unsigned benchItems = 0;
+    const char* optReportPath = NULL;
+    bool profile = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--pipeline")) {
+            pipelined = true;
+        } else if (!strcmp(argv[i], "--concurrent")) {
+            concurrent = true;
+        } else if (!strcmp(argv[i], "--watch")) {
+            watch = true;
+        } else if (!strcmp(argv[i], "--fast-math")) {
+            fastMath = true;
+        } else if (!strcmp(argv[i], "--prelude") && i + 1 < argc) {
+            preludes.push_back(argv[++i]);
+        } else if (!strcmp(argv[i], "--restore") && i + 1 < argc) {
+            restorePath = argv[++i];
+        } else if (!strcmp(argv[i], "--savable")) {
+            savable = true;
+        } else if (!strcmp(argv[i], "--ast-cache") && i + 1 < argc) {
+            astCacheDir = argv[++i];
+        } else if (!strcmp(argv[i], "--map") && i + 1 < argc) {
+            mapFunction = argv[++i];
+        } else if (!strcmp(argv[i], "--memo-capacity") && i + 1 < argc) {
+            memoCapacity = max(1L, atol(argv[++i]));
+        } else if (!strcmp(argv[i], "--memo-evict") && i + 1 < argc &&
+                   (!strcmp(argv[i + 1], "lru") ||
+                    !strcmp(argv[i + 1], "none") ||
+                    !strcmp(argv[i + 1], "grow"))) {
+            ++i;
+            memoEvict = !strcmp(argv[i], "lru")    ? evictLru
+                        : !strcmp(argv[i], "none") ? evictNone
+                                                   : evictGrow;
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            parallelThreads = max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--object-cache-size") && i + 1 < argc) {
+            objectCacheLimit = (size_t)max(0L, atol(argv[++i])) << 20;
+        } else if (!strcmp(argv[i], "--mem-report")) {
+            memReport = true;
+        } else if (!strcmp(argv[i], "--executors") && i + 1 < argc) {
+            executors = max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--exec-timeout") && i + 1 < argc) {
+            execTimeout = max(0, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--profile")) {
+            profile = true;
+        } else if (!strcmp(argv[i], "--opt-report") && i + 1 < argc) {
+            optReportPath = argv[++i];
+        } else if (!strcmp(argv[i], "--bench-compile") && i + 1 < argc) {
+            benchItems = max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--executor")) {
+            executorMode = true;  // started by --executors, see executorPool
+        } else if (!strcmp(argv[i], "--input") && i + 1 < argc) {
+            mapInput = argv[++i];
+        } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            mapOutput = argv[++i];
+        } else if (argv[i][0] != '-' && !sourcePath) {
+            sourcePath = argv[i];
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            servePath = argv[++i];
+        } else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+            workers = max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--load") && i + 2 < argc) {
+            loadPath = argv[++i];
+            loadSource = argv[++i];
+        } else if (!strcmp(argv[i], "--clients") && i + 1 < argc) {
+            clients = max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--rounds") && i + 1 < argc) {
+            rounds = max(1, atoi(argv[++i]));
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
 
-    BinOpPrecedence['<'] = 10;
-    BinOpPrecedence['+'] = 20;
-    BinOpPrecedence['-'] = 30;
-    BinOpPrecedence['*'] = 40;  //highest
+    // the load generator is a plain client and needs no LLVM at all
+    if (loadPath) return runLoadGenerator(loadPath, loadSource, clients, rounds);
+    if (executorMode) return runExecutor();
+    if (optReportPath) {
+        error_code EC;
+        optReport = make_unique<raw_fd_ostream>(optReportPath, EC);
+        if (EC) {
+            fprintf(stderr, "jvavc: %s: %s\n", optReportPath,
+                    EC.message().c_str());
+            return 1;
+        }
+        EnableStatistics(false);
+    }
+    if (benchItems) {
+        int status = runCompileBench(benchItems);
+        theEngine.reset();
+        return status;
+    }
+    if (pipelined && !sourcePath) {
+        fprintf(stderr, "jvavc: --pipeline needs a source file\n");
+        return 1;
+    }
+    if (concurrent && (!sourcePath || pipelined)) {
+        fprintf(stderr, "jvavc: --concurrent needs a source file and no "
+                        "--pipeline\n");
+        return 1;
+    }
+    if (watch && (!sourcePath || pipelined || concurrent || mapFunction)) {
+        fprintf(stderr, "jvavc: --watch needs a source file and no --pipeline, "
+                        "--concurrent or --map\n");
+        return 1;
+    }
+    if (!mapFunction != !mapInput) {
+        fprintf(stderr, "jvavc: --map and --input go together\n");
+        return 1;
+    }
+    if (executors && mapFunction) {
+        fprintf(stderr, "jvavc: --map runs in process, not with --executors\n");
+        return 1;
+    }
+    if (executors && restorePath) {
+        fprintf(stderr, "jvavc: --restore loads code in process, not with "
+                        "--executors\n");
+        return 1;
+    }
+    if (restorePath && access(restorePath, R_OK) != 0) {
+        perror(restorePath);
+        return 1;
+    }
+    if (profile && (executors || servePath)) {
+        fprintf(stderr, "jvavc: --profile samples this process until it "
+                        "exits, not with --executors or --serve\n");
+        return 1;
+    }
+    if (profile) {
+        theProfiler = make_unique<samplingProfiler>();
+        if (!theProfiler->start()) {
+            fprintf(stderr, "jvavc: --profile is not supported here\n");
+            return 1;
+        }
+        profileListener = theProfiler.get();
+    }
+    FILE* source = stdin;
+    if (sourcePath && !(source = fopen(sourcePath, "r"))) {
+        perror(sourcePath);
+        return 1;
+    }
 
-    // Prime the first token.
-    fprintf(stderr, "ready> ");
-    getNextToken();
+    if (executors) {
+        // an executor is this program again, with the options it needs
+        vector<string> args = {argv[0], "--executor", "--memo-capacity",
+                               to_string(memoCapacity), "--memo-evict",
+                               memoEvict == evictLru    ? "lru"
+                               : memoEvict == evictNone ? "none"
+                                                        : "grow"};
+        if (parallelThreads) {
+            args.push_back("--threads");
+            args.push_back(to_string(parallelThreads));
+        }
+        theExecutors = make_unique<executorPool>(executors, execTimeout,
+                                                 move(args));
+        remoteExecution = true;
+    }
 
-    theJIT = make_unique<KaleidoscopeJIT>();
+    int status = 0;
+    if (servePath) {
+        // warm before the first client rather than during its request
+        startEngine();
+        status = serveSessions(servePath, workers);
+    } else if (pipelined) {
+        beginSession(source, stderr, false, "main");
+        if (mapFunction) mapTarget = mapFunction;
+        if (restorePath) restoreSnapshot(restorePath);
+        for (auto* prelude : preludes) loadPrelude(prelude, astCacheDir);
+        runPipelined(source);
+        if (mapFunction) status = runMap(mapInput, mapOutput);
+        endSession();
+    } else if (watch) {
+        beginSession(stdin, stderr, false, "main");
+        if (restorePath) restoreSnapshot(restorePath);
+        for (auto* prelude : preludes) loadPrelude(prelude, astCacheDir);
+        status = runWatch(sourcePath);
+        endSession();
+    } else if (concurrent) {
+        beginSession(source, stderr, false, "main");
+        if (mapFunction) mapTarget = mapFunction;
+        if (restorePath) restoreSnapshot(restorePath);
+        for (auto* prelude : preludes) loadPrelude(prelude, astCacheDir);
+        runConcurrent();
+        if (mapFunction) status = runMap(mapInput, mapOutput);
+        endSession();
+    } else {
+        // only an interactive read-eval-print loop prompts
+        beginSession(source, stderr, !sourcePath && !mapFunction, "main");
+        if (mapFunction) mapTarget = mapFunction;
+        if (restorePath) restoreSnapshot(restorePath);
+        for (auto* prelude : preludes) loadPrelude(prelude, astCacheDir);
 
-    initializeModuleAndPassManager();
+        // Prime the first token.
+        if (sessionPrompt) fprintf(sessionOut, "ready> ");
+        getNextToken();
 
-    // Run the main "interpreter loop" now.
-    MainLoop();
+        // Run the main "interpreter loop" now.
+        MainLoop();
+        if (mapFunction) status = runMap(mapInput, mapOutput);
+        endSession();
+    }
+    if (source != stdin) fclose(source);
 
-    return 0;
-}
\ No newline at end of file
+    if (theProfiler) {
+        theProfiler->stop();
+        theProfiler->report(stderr);
+    }
+    theExecutors.reset();
+    theEngine.reset();
+    optReport.reset();
+    return status;
+}